@@ -24,6 +24,13 @@ void msg_keyboard_report(Message *msg, const HIDKeyboardReport *report) {
     }
 }
 
+void msg_keyboard_bitmap(Message *msg, const HIDKeyboardBitmap *bitmap) {
+    if (msg && bitmap) {
+        msg->type = MSG_KEYBOARD_BITMAP;
+        memcpy(&msg->data.keyboard_bitmap, bitmap, sizeof(HIDKeyboardBitmap));
+    }
+}
+
 void msg_switch(Message *msg, uint8_t state) {
     if (msg) {
         msg->type = MSG_SWITCH;
@@ -37,4 +44,465 @@ void msg_mouse_wheel(Message *msg, int16_t vertical, int16_t horizontal) {
         msg->data.mouse_wheel.vertical = vertical;
         msg->data.mouse_wheel.horizontal = horizontal;
     }
-}
\ No newline at end of file
+}
+
+void msg_mouse_report(Message *msg, uint8_t buttons, int16_t dx, int16_t dy,
+                      int8_t vertical, int8_t horizontal) {
+    if (msg) {
+        msg->type = MSG_MOUSE_REPORT;
+        msg->data.mouse_report.buttons    = buttons;
+        msg->data.mouse_report.dx         = dx;
+        msg->data.mouse_report.dy         = dy;
+        msg->data.mouse_report.vertical   = vertical;
+        msg->data.mouse_report.horizontal = horizontal;
+    }
+}
+
+void msg_hello(Message *msg, uint16_t features) {
+    if (msg) {
+        msg->type = MSG_HELLO;
+        msg->data.hello.version  = MSG_PROTOCOL_VERSION;
+        msg->data.hello.features = features;
+    }
+}
+
+void msg_hello_ack(Message *msg, uint16_t features, uint32_t max_baud, uint16_t queue_depth) {
+    if (msg) {
+        msg->type = MSG_HELLO_ACK;
+        msg->data.hello.version     = MSG_PROTOCOL_VERSION;
+        msg->data.hello.features    = features;
+        msg->data.hello.max_baud    = max_baud;
+        msg->data.hello.queue_depth = queue_depth;
+    }
+}
+
+void msg_set_baud(Message *msg, uint32_t rate) {
+    if (msg) {
+        msg->type = MSG_SET_BAUD;
+        msg->data.baud.rate = rate;
+    }
+}
+
+void msg_latency_probe(Message *msg, uint16_t id, uint32_t device_us) {
+    if (msg) {
+        msg->type = MSG_LATENCY_PROBE;
+        msg->data.probe.id        = id;
+        msg->data.probe.device_us = device_us;
+    }
+}
+
+static int bitmap_test(const HIDKeyboardBitmap *bitmap, unsigned usage) {
+    return usage < 8 * MSG_KEY_BITMAP_BYTES && ((bitmap->keys[usage / 8] >> (usage % 8)) & 1);
+}
+
+void msg_report_to_bitmap(const HIDKeyboardReport *report, HIDKeyboardBitmap *bitmap) {
+    memset(bitmap, 0, sizeof(*bitmap));
+    bitmap->modifiers = report->modifiers;
+    for (int i = 0; i < 6; i++) {
+        uint8_t usage = report->keys[i];
+        if (usage != 0 && usage < 8 * MSG_KEY_BITMAP_BYTES) {
+            bitmap->keys[usage / 8] |= (uint8_t)(1u << (usage % 8));
+        }
+    }
+}
+
+int msg_bitmap_to_report(const HIDKeyboardBitmap *bitmap, HIDKeyboardReport *report) {
+    int slots = 0;
+    int left_out = 0;
+
+    /* Keys still held keep their relative order, released ones leave */
+    for (int i = 0; i < 6; i++) {
+        uint8_t usage = report->keys[i];
+        if (usage != 0 && bitmap_test(bitmap, usage)) report->keys[slots++] = usage;
+    }
+    int kept = slots;
+    for (int i = slots; i < 6; i++) report->keys[i] = 0;
+
+    for (unsigned usage = 1; usage < 8 * MSG_KEY_BITMAP_BYTES; usage++) {
+        if (!bitmap_test(bitmap, usage)) continue;
+        if (memchr(report->keys, (int)usage, (size_t)kept)) continue;
+        if (slots < 6) report->keys[slots++] = (uint8_t)usage;
+        else           left_out++;
+    }
+    report->modifiers = bitmap->modifiers;
+    report->reserved  = 0;
+    return left_out;
+}
+
+/* ------------------------------------------------------------------ */
+/* UART framing                                                         */
+/* ------------------------------------------------------------------ */
+static const uint8_t crc8_table[256] = {
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15,
+    0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+    0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65,
+    0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+    0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5,
+    0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+    0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85,
+    0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+    0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2,
+    0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+    0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2,
+    0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+    0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32,
+    0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+    0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42,
+    0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+    0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C,
+    0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+    0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC,
+    0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+    0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C,
+    0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+    0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C,
+    0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+    0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B,
+    0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+    0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B,
+    0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+    0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB,
+    0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+    0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB,
+    0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3,
+};
+
+/* Seeded with 0xFF: from 0, a frame whose delimiter was lost would carry
+ * the next frame's CRC through intact (the first frame plus its CRC
+ * leaves the register at 0, and so does COBS's implied 0x00 between
+ * them), so the merged frame would pass. */
+uint8_t msg_crc8(const uint8_t *data, size_t len) {
+    uint8_t crc = 0xFF;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc8_table[crc ^ data[i]];
+    }
+    return crc;
+}
+
+/* COBS-encode len bytes (len < 254) and append the delimiter. */
+static size_t cobs_encode(const uint8_t *in, size_t len, uint8_t *out) {
+    size_t code_pos = 0;
+    size_t o = 1;
+    uint8_t code = 1;
+
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] == 0) {
+            out[code_pos] = code;
+            code_pos = o++;
+            code = 1;
+        } else {
+            out[o++] = in[i];
+            code++;
+        }
+    }
+    out[code_pos] = code;
+    out[o++] = MSG_FRAME_DELIM;
+    return o;
+}
+
+/* Decode a COBS block in place (delimiter already stripped).
+ * Returns the decoded length, or 0 if the block is malformed. */
+static size_t cobs_decode(uint8_t *buf, size_t len) {
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < len) {
+        uint8_t code = buf[i++];
+        if (code == 0 || i + code - 1 > len) return 0;
+        for (uint8_t k = 1; k < code; k++) {
+            buf[o++] = buf[i++];
+        }
+        if (code != 0xFF && i < len) {
+            buf[o++] = 0;
+        }
+    }
+    return o;
+}
+
+static size_t put_uvarint(uint8_t *out, uint32_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+/* Returns bytes consumed, or 0 if the varint is truncated or exceeds max. */
+static size_t get_uvarint(const uint8_t *buf, size_t len, uint32_t max, uint32_t *value) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < len && i < 5; i++) {
+        v |= (uint64_t)(buf[i] & 0x7F) << (7 * i);
+        if (!(buf[i] & 0x80)) {
+            if (v > max) return 0;
+            *value = (uint32_t)v;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* ZigZag varint: small magnitudes of either sign fit in one byte */
+static size_t put_varint(uint8_t *out, int16_t value) {
+    return put_uvarint(out, (uint16_t)(((uint16_t)value << 1) ^ (uint16_t)(value >> 15)));
+}
+
+static size_t get_varint(const uint8_t *buf, size_t len, int16_t *value) {
+    uint32_t zz;
+    size_t used = get_uvarint(buf, len, 0xFFFF, &zz);
+    if (used) *value = (int16_t)((zz >> 1) ^ (0u - (zz & 1)));
+    return used;
+}
+
+size_t msg_encode(const Message *msg, uint8_t *out) {
+    size_t n = 0;
+    out[n++] = msg->type;
+
+    switch (msg->type) {
+        case MSG_MOUSE_MOVE:
+            n += put_varint(out + n, msg->data.mouse_move.dx);
+            n += put_varint(out + n, msg->data.mouse_move.dy);
+            break;
+        case MSG_MOUSE_BUTTON:
+            out[n++] = (uint8_t)((msg->data.mouse_button.button & 0x7F) |
+                                 (msg->data.mouse_button.state ? 0x80 : 0));
+            break;
+        case MSG_KEYBOARD_REPORT: {
+            int keys = 6;
+            while (keys > 0 && msg->data.keyboard.keys[keys - 1] == 0) keys--;
+            out[n++] = msg->data.keyboard.modifiers;
+            memcpy(out + n, msg->data.keyboard.keys, (size_t)keys);
+            n += (size_t)keys;
+            break;
+        }
+        case MSG_KEYBOARD_BITMAP: {
+            int bytes = MSG_KEY_BITMAP_BYTES;
+            while (bytes > 0 && msg->data.keyboard_bitmap.keys[bytes - 1] == 0) bytes--;
+            out[n++] = msg->data.keyboard_bitmap.modifiers;
+            memcpy(out + n, msg->data.keyboard_bitmap.keys, (size_t)bytes);
+            n += (size_t)bytes;
+            break;
+        }
+        case MSG_SWITCH:
+            out[n++] = msg->data.control.state;
+            break;
+        case MSG_MOUSE_WHEEL:
+            n += put_varint(out + n, msg->data.mouse_wheel.vertical);
+            n += put_varint(out + n, msg->data.mouse_wheel.horizontal);
+            break;
+        case MSG_MOUSE_REPORT:
+            out[n++] = msg->data.mouse_report.buttons;
+            n += put_varint(out + n, msg->data.mouse_report.dx);
+            n += put_varint(out + n, msg->data.mouse_report.dy);
+            if (msg->data.mouse_report.vertical != 0 || msg->data.mouse_report.horizontal != 0) {
+                out[n++] = (uint8_t)msg->data.mouse_report.vertical;
+            }
+            if (msg->data.mouse_report.horizontal != 0) {
+                out[n++] = (uint8_t)msg->data.mouse_report.horizontal;
+            }
+            break;
+        case MSG_HELLO:
+            out[n++] = msg->data.hello.version;
+            n += put_uvarint(out + n, msg->data.hello.features);
+            break;
+        case MSG_HELLO_ACK:
+            out[n++] = msg->data.hello.version;
+            n += put_uvarint(out + n, msg->data.hello.features);
+            n += put_uvarint(out + n, msg->data.hello.max_baud);
+            n += put_uvarint(out + n, msg->data.hello.queue_depth);
+            break;
+        case MSG_SET_BAUD:
+            n += put_uvarint(out + n, msg->data.baud.rate);
+            break;
+        case MSG_LATENCY_PROBE:
+            n += put_uvarint(out + n, msg->data.probe.id);
+            if (msg->data.probe.device_us != 0) {
+                n += put_uvarint(out + n, msg->data.probe.device_us);
+            }
+            break;
+        default:
+            return 0;
+    }
+    return n;
+}
+
+/* Message is packed, so its int16_t/uint32_t fields may sit at odd
+ * addresses: varints are decoded into locals and stored by value, never
+ * through a pointer to a member (a misaligned store faults on Xtensa). */
+int msg_decode(const uint8_t *buf, size_t len, Message *msg) {
+    size_t n = 1;
+    size_t used;
+    int16_t a, b;
+
+    if (len < 2) return 0;
+    memset(msg, 0, sizeof(*msg));
+    msg->type = buf[0];
+
+    switch (msg->type) {
+        case MSG_MOUSE_MOVE:
+            if (!(used = get_varint(buf + n, len - n, &a))) return 0;
+            n += used;
+            if (!(used = get_varint(buf + n, len - n, &b))) return 0;
+            n += used;
+            msg->data.mouse_move.dx = a;
+            msg->data.mouse_move.dy = b;
+            break;
+        case MSG_MOUSE_BUTTON:
+            msg->data.mouse_button.button = buf[n] & 0x7F;
+            msg->data.mouse_button.state  = (buf[n] & 0x80) ? BUTTON_PRESSED : BUTTON_RELEASED;
+            n++;
+            break;
+        case MSG_KEYBOARD_REPORT:
+            if (len - n > 1 + sizeof(msg->data.keyboard.keys)) return 0;
+            msg->data.keyboard.modifiers = buf[n++];
+            memcpy(msg->data.keyboard.keys, buf + n, len - n);
+            n = len;
+            break;
+        case MSG_KEYBOARD_BITMAP:
+            if (len - n > 1 + sizeof(msg->data.keyboard_bitmap.keys)) return 0;
+            msg->data.keyboard_bitmap.modifiers = buf[n++];
+            memcpy(msg->data.keyboard_bitmap.keys, buf + n, len - n);
+            n = len;
+            break;
+        case MSG_SWITCH:
+            msg->data.control.state = buf[n++];
+            break;
+        case MSG_MOUSE_WHEEL:
+            if (!(used = get_varint(buf + n, len - n, &a))) return 0;
+            n += used;
+            if (!(used = get_varint(buf + n, len - n, &b))) return 0;
+            n += used;
+            msg->data.mouse_wheel.vertical   = a;
+            msg->data.mouse_wheel.horizontal = b;
+            break;
+        case MSG_MOUSE_REPORT:
+            msg->data.mouse_report.buttons = buf[n++];
+            if (!(used = get_varint(buf + n, len - n, &a))) return 0;
+            n += used;
+            if (!(used = get_varint(buf + n, len - n, &b))) return 0;
+            n += used;
+            msg->data.mouse_report.dx = a;
+            msg->data.mouse_report.dy = b;
+            if (n < len) msg->data.mouse_report.vertical   = (int8_t)buf[n++];
+            if (n < len) msg->data.mouse_report.horizontal = (int8_t)buf[n++];
+            break;
+        case MSG_HELLO:
+        case MSG_HELLO_ACK: {
+            uint32_t v;
+            msg->data.hello.version = buf[n++];
+            if (!(used = get_uvarint(buf + n, len - n, 0xFFFF, &v))) return 0;
+            msg->data.hello.features = (uint16_t)v;
+            n += used;
+            if (msg->type == MSG_HELLO) break;
+            if (!(used = get_uvarint(buf + n, len - n, UINT32_MAX, &v))) return 0;
+            msg->data.hello.max_baud = v;
+            n += used;
+            if (!(used = get_uvarint(buf + n, len - n, 0xFFFF, &v))) return 0;
+            msg->data.hello.queue_depth = (uint16_t)v;
+            n += used;
+            break;
+        }
+        case MSG_SET_BAUD: {
+            uint32_t v;
+            if (!(used = get_uvarint(buf + n, len - n, UINT32_MAX, &v))) return 0;
+            msg->data.baud.rate = v;
+            n += used;
+            break;
+        }
+        case MSG_LATENCY_PROBE: {
+            uint32_t v;
+            if (!(used = get_uvarint(buf + n, len - n, 0xFFFF, &v))) return 0;
+            msg->data.probe.id = (uint16_t)v;
+            n += used;
+            if (n < len) {
+                if (!(used = get_uvarint(buf + n, len - n, UINT32_MAX, &v))) return 0;
+                msg->data.probe.device_us = v;
+                n += used;
+            }
+            break;
+        }
+        default:
+            return 0;
+    }
+    return n == len;
+}
+
+size_t msg_frame_encode(const Message *msg, uint8_t *out) {
+    uint8_t payload[MSG_PAYLOAD_MAX + 1];
+    size_t len = msg_encode(msg, payload);
+
+    if (len == 0) return 0;
+    payload[len] = msg_crc8(payload, len);
+    return cobs_encode(payload, len + 1, out);
+}
+
+static void put_le16(uint8_t *out, int16_t v) {
+    out[0] = (uint8_t)((uint16_t)v & 0xFF);
+    out[1] = (uint8_t)((uint16_t)v >> 8);
+}
+
+size_t msg_legacy_encode(const Message *msg, uint8_t *out) {
+    memset(out, 0, MSG_LEGACY_SIZE);
+    out[0] = msg->type;
+
+    switch (msg->type) {
+        case MSG_MOUSE_MOVE:
+            put_le16(out + 1, msg->data.mouse_move.dx);
+            put_le16(out + 3, msg->data.mouse_move.dy);
+            break;
+        case MSG_MOUSE_BUTTON:
+            out[1] = msg->data.mouse_button.button;
+            out[2] = msg->data.mouse_button.state;
+            break;
+        case MSG_KEYBOARD_REPORT:
+            memcpy(out + 1, &msg->data.keyboard, sizeof(HIDKeyboardReport));
+            break;
+        case MSG_SWITCH:
+            out[1] = msg->data.control.state;
+            break;
+        case MSG_MOUSE_WHEEL:
+            put_le16(out + 1, msg->data.mouse_wheel.vertical);
+            put_le16(out + 3, msg->data.mouse_wheel.horizontal);
+            break;
+        default:
+            return 0;
+    }
+    return MSG_LEGACY_SIZE;
+}
+
+void msg_parser_init(MsgParser *parser) {
+    memset(parser, 0, sizeof(*parser));
+}
+
+int msg_parser_feed(MsgParser *parser, uint8_t byte, Message *msg) {
+    if (byte != MSG_FRAME_DELIM) {
+        if (parser->len < sizeof(parser->buf)) {
+            parser->buf[parser->len++] = byte;
+        } else {
+            parser->overflow = 1;
+        }
+        return 0;
+    }
+
+    /* Delimiter: whatever was collected is one frame, good or bad */
+    size_t len = parser->len;
+    int overflow = parser->overflow;
+    parser->len = 0;
+    parser->overflow = 0;
+
+    if (len == 0) return 0;  /* back-to-back delimiters are idle fill */
+
+    if (!overflow) {
+        len = cobs_decode(parser->buf, len);
+        if (len >= 2 &&
+            msg_crc8(parser->buf, len - 1) == parser->buf[len - 1] &&
+            msg_decode(parser->buf, len - 1, msg)) {
+            parser->frames_ok++;
+            return 1;
+        }
+    }
+
+    parser->frames_bad++;
+    return 0;
+}
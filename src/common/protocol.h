@@ -2,6 +2,7 @@
 #define PROTOCOL_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #pragma pack(push, 1)
 
@@ -12,6 +13,13 @@ typedef struct {
     uint8_t keys[6];       // 最多6个同时按下的按键
 } HIDKeyboardReport;
 
+// 位图键盘状态（NKRO）：HID 用途 0x00-0x7F 每个占一位，同时按下的按键数不受限制
+#define MSG_KEY_BITMAP_BYTES 16
+typedef struct {
+    uint8_t modifiers;                   // 修饰键位掩码
+    uint8_t keys[MSG_KEY_BITMAP_BYTES];  // 用途 u 在 keys[u / 8] 的第 (u % 8) 位
+} HIDKeyboardBitmap;
+
 // 统一的二进制消息格式
 typedef struct {
     uint8_t type;          // 消息类型
@@ -26,6 +34,7 @@ typedef struct {
             uint8_t padding[2]; // 填充
         } mouse_button;
         HIDKeyboardReport keyboard; // 键盘HID报告（8字节）
+        HIDKeyboardBitmap keyboard_bitmap; // 位图键盘状态（17字节）
         struct {
             uint8_t state;  // 控制状态（0=本地，1=远程）
             uint8_t padding[3]; // 填充
@@ -34,6 +43,26 @@ typedef struct {
             int16_t vertical;   // 垂直滚轮（通常为正=向上，负=向下）
             int16_t horizontal; // 水平滚轮（通常为正=向右，负=向左）
         } mouse_wheel;
+        struct {
+            uint8_t buttons;    // 按键位掩码 (bit0=左, bit1=右, bit2=中)
+            int16_t dx;         // 鼠标X位移
+            int16_t dy;         // 鼠标Y位移
+            int8_t  vertical;   // 垂直滚轮
+            int8_t  horizontal; // 水平滚轮
+        } mouse_report;         // 一个输入帧的完整鼠标状态（对应 HID 鼠标报告）
+        struct {
+            uint8_t  version;     // 协议版本（MSG_PROTOCOL_VERSION）
+            uint16_t features;    // MSG_FEAT_* 位掩码
+            uint32_t max_baud;    // 支持的最高波特率（仅 HELLO_ACK）
+            uint16_t queue_depth; // 固件 HID 队列深度（仅 HELLO_ACK）
+        } hello;                  // 启动握手（HELLO / HELLO_ACK）
+        struct {
+            uint32_t rate;        // 新波特率
+        } baud;                   // 波特率切换请求 / 确认
+        struct {
+            uint16_t id;          // 服务器分配的探测序号
+            uint32_t device_us;   // 固件：收到探测帧到承载它的 HID 报告发送完成（仅回送）
+        } probe;                  // 延迟探测
     } data;
 } Message;
 
@@ -45,9 +74,31 @@ enum MessageType {
     MSG_MOUSE_BUTTON = 0x02,
     MSG_KEYBOARD_REPORT = 0x03,  // 发送完整的HID键盘报告
     MSG_SWITCH = 0x04,
-    MSG_MOUSE_WHEEL = 0x05       // 鼠标滚轮事件
+    MSG_MOUSE_WHEEL = 0x05,      // 鼠标滚轮事件
+    MSG_MOUSE_REPORT = 0x06,     // 按键+位移+滚轮合并的鼠标报告
+    MSG_HELLO = 0x07,            // 服务器 → 固件：版本与功能位
+    MSG_HELLO_ACK = 0x08,        // 固件 → 服务器：版本、功能位、最高波特率、队列深度
+    MSG_SET_BAUD = 0x09,         // 服务器请求切换波特率；固件以原波特率回送同一消息确认
+    MSG_LATENCY_PROBE = 0x0A,    // 延迟探测；固件在前一个 HID 报告发送完成后回送
+    MSG_KEYBOARD_BITMAP = 0x0B   // 位图键盘状态（NKRO），固件不支持时服务器转为 MSG_KEYBOARD_REPORT
 };
 
+// 协议版本：1 = 旧版固定 9 字节消息（无分帧），2 = COBS 分帧 + 握手
+#define MSG_PROTOCOL_VERSION 2
+#define MSG_LEGACY_SIZE      9
+
+// 链路波特率范围，服务器和固件共用：服务器只请求、固件只接受这个范围内的波特率
+// （固件 Kconfig 中 ONEKM_UART_BAUD_RATE 的 range 与此一致）
+#define MSG_BAUD_MIN         9600
+#define MSG_BAUD_MAX         5000000   // ESP32 UART 上限
+
+// 功能位（HELLO / HELLO_ACK）
+#define MSG_FEAT_MOUSE_REPORT  0x0001  // 支持 MSG_MOUSE_REPORT
+#define MSG_FEAT_BAUD_SWITCH   0x0002  // 支持 MSG_SET_BAUD
+#define MSG_FEAT_FLOW_CONTROL  0x0004  // 已启用 RTS/CTS 硬件流控
+#define MSG_FEAT_LATENCY_PROBE 0x0008  // 支持 MSG_LATENCY_PROBE 回送
+#define MSG_FEAT_NKRO          0x0010  // 支持 MSG_KEYBOARD_BITMAP
+
 // 鼠标按键定义
 enum MouseButton {
     MOUSE_BUTTON_LEFT = 0x01,
@@ -81,10 +132,88 @@ enum ControlState {
 void msg_mouse_move(Message *msg, int16_t dx, int16_t dy);
 void msg_mouse_button(Message *msg, uint8_t button, uint8_t state);
 void msg_keyboard_report(Message *msg, const HIDKeyboardReport *report);
+void msg_keyboard_bitmap(Message *msg, const HIDKeyboardBitmap *bitmap);
 void msg_switch(Message *msg, uint8_t state);
 void msg_mouse_wheel(Message *msg, int16_t vertical, int16_t horizontal);
+void msg_mouse_report(Message *msg, uint8_t buttons, int16_t dx, int16_t dy,
+                      int8_t vertical, int8_t horizontal);
+void msg_hello(Message *msg, uint16_t features);
+void msg_hello_ack(Message *msg, uint16_t features, uint32_t max_baud, uint16_t queue_depth);
+void msg_set_baud(Message *msg, uint32_t rate);
+void msg_latency_probe(Message *msg, uint16_t id, uint32_t device_us);
+
+/* Conversions between the 6KRO report and the key bitmap, for a peer or a
+ * host that only takes one of them. msg_bitmap_to_report() updates report
+ * in place so that keys already in it keep their slot, released keys leave
+ * and newly held ones fill free slots in usage order; a key that does not
+ * fit gets a slot once another is released. Returns the number of held
+ * keys left out. */
+void msg_report_to_bitmap(const HIDKeyboardReport *report, HIDKeyboardBitmap *bitmap);
+int  msg_bitmap_to_report(const HIDKeyboardBitmap *bitmap, HIDKeyboardReport *report);
 
 // Legacy function (removed - no longer needed)
 // void msg_key_event(Message *msg, uint16_t keycode, uint8_t state);
 
+/* ------------------------------------------------------------------ */
+/* UART framing                                                         */
+/* ------------------------------------------------------------------ */
+/*
+ * 线路帧格式：COBS(payload | CRC-8) 0x00
+ *
+ * COBS 编码保证帧内不出现 0x00，因此 0x00 只作为帧分隔符。接收端丢失或
+ * 多出一个字节时，只损坏当前帧；下一个 0x00 之后立即重新同步。
+ * CRC-8 多项式 0x07、初值 0xFF，覆盖整个 payload；解码后的长度必须与消息类型匹配。
+ *
+ * payload 为按类型变长的紧凑编码（第一个字节为消息类型）：
+ *   MSG_MOUSE_MOVE       type, zigzag varint dx, zigzag varint dy
+ *   MSG_MOUSE_BUTTON     type, button | (state << 7)
+ *   MSG_KEYBOARD_REPORT  type, modifiers, keys[0..n)（省略末尾的 0）
+ *   MSG_SWITCH           type, state
+ *   MSG_MOUSE_WHEEL      type, zigzag varint vertical, zigzag varint horizontal
+ *   MSG_MOUSE_REPORT     type, buttons, zigzag varint dx, zigzag varint dy,
+ *                        [vertical, [horizontal]]（省略末尾为 0 的滚轮）
+ *   MSG_HELLO            type, version, varint features
+ *   MSG_HELLO_ACK        type, version, varint features, varint max_baud,
+ *                        varint queue_depth
+ *   MSG_SET_BAUD         type, varint rate
+ *   MSG_LATENCY_PROBE    type, varint id, [varint device_us]（仅固件回送时带）
+ *   MSG_KEYBOARD_BITMAP  type, modifiers, keys[0..n)（省略末尾的 0）
+ * |delta| < 64 的鼠标移动只需 3 字节 payload，按键变化只需 2 字节。
+ */
+#define MSG_FRAME_DELIM    0x00
+#define MSG_PAYLOAD_MAX    (2 + MSG_KEY_BITMAP_BYTES)  /* longest payload: MSG_KEYBOARD_BITMAP */
+#define MSG_FRAME_MAX      (MSG_PAYLOAD_MAX + 3)       /* + CRC + COBS code + delimiter */
+
+typedef struct {
+    uint8_t  buf[MSG_FRAME_MAX];  // 当前帧的原始（COBS 编码）字节
+    uint8_t  len;
+    uint8_t  overflow;            // 帧过长，丢弃直到下一个分隔符
+    uint32_t frames_ok;
+    uint32_t frames_bad;          // CRC / 长度 / COBS 错误或超长帧
+} MsgParser;
+
+uint8_t msg_crc8(const uint8_t *data, size_t len);
+
+/* Compact payload encoding. out must hold at least MSG_PAYLOAD_MAX bytes.
+ * msg_encode returns the payload length (0 for an unknown type);
+ * msg_decode returns 1 if buf is a well-formed payload, 0 otherwise. */
+size_t msg_encode(const Message *msg, uint8_t *out);
+int    msg_decode(const uint8_t *buf, size_t len, Message *msg);
+
+/* Encode msg as one complete frame (including the trailing delimiter).
+ * out must hold at least MSG_FRAME_MAX bytes. Returns the frame length,
+ * or 0 for an unknown message type. */
+size_t msg_frame_encode(const Message *msg, uint8_t *out);
+
+/* Encode msg in the version-1 fixed 9-byte layout understood by old
+ * firmware (type followed by the little-endian union). Only types 0x01-0x05
+ * exist there; returns MSG_LEGACY_SIZE, or 0 for any other type. */
+size_t msg_legacy_encode(const Message *msg, uint8_t *out);
+
+void msg_parser_init(MsgParser *parser);
+
+/* Feed one received byte. Returns 1 when a valid frame completed and msg
+ * was filled, 0 otherwise. Corrupt frames are counted and dropped. */
+int  msg_parser_feed(MsgParser *parser, uint8_t byte, Message *msg);
+
 #endif // PROTOCOL_H
\ No newline at end of file
@@ -9,7 +9,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include "sdkconfig.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
@@ -21,6 +24,7 @@
 #include "tinyusb.h"
 #include "tinyusb_default_config.h"
 #include "class/hid/hid_device.h"
+#include "protocol.h"
 
 #define TAG "onekm"
 
@@ -28,69 +32,170 @@
 #define UART_NUM UART_NUM_0
 #define UART_TX_PIN GPIO_NUM_43
 #define UART_RX_PIN GPIO_NUM_44
-static const int UART_BAUD_RATE = 230400;  // 波特率（可修改为230400等）
+static const int UART_BAUD_RATE = CONFIG_ONEKM_UART_BAUD_RATE;  // 波特率（menuconfig 中配置）
 #define UART_BUF_SIZE 128
+#define UART_RX_RING_SIZE 2048      // 驱动接收缓冲区，高波特率下容纳任务调度延迟期间的数据
+#define UART_RX_FLOW_THRESH 100     // RX FIFO 达到该字节数时拉高 RTS（FIFO 共 128 字节）
+#define UART_BAUD_MIN MSG_BAUD_MIN
+#define UART_BAUD_MAX MSG_BAUD_MAX  // 握手时告知服务器的最高波特率
+#define UART_BAUD_PROBE_MS 500      // 切换波特率后在此时间内未收到有效帧则恢复原波特率
+#define UART_GARBLED_LIMIT 4        // 非启动波特率下连续这么多次帧错误/坏帧即恢复启动波特率
+
+#if CONFIG_ONEKM_UART_FLOW_CONTROL
+#define LINK_FEATURES (MSG_FEAT_MOUSE_REPORT | MSG_FEAT_BAUD_SWITCH | MSG_FEAT_LATENCY_PROBE | \
+                       MSG_FEAT_NKRO | MSG_FEAT_FLOW_CONTROL)
+#else
+#define LINK_FEATURES (MSG_FEAT_MOUSE_REPORT | MSG_FEAT_BAUD_SWITCH | MSG_FEAT_LATENCY_PROBE | \
+                       MSG_FEAT_NKRO)
+#endif
+#define UART_EVENT_QUEUE_LEN 16
+#define UART_RX_TIMEOUT_SYMBOLS 2   // 线路空闲 2 个字符时间即触发 RX 超时中断
 
 // 按钮配置
 #define APP_BUTTON GPIO_NUM_0
 
-// 共享数据结构
-typedef struct {
-    int16_t x;              // X 位移（累积值）
-    int16_t y;              // Y 位移（累积值）
-    int8_t vertical_wheel;  // 垂直滚轮（累积值）
-    int8_t horizontal_wheel; // 水平滚轮（累积值）
-    uint8_t buttons;        // 按键位掩码 (bit0=左, bit1=右, bit2=中)
-    bool changed;           // 状态变化标志
-} mouse_state_t;
-
-// 键盘直接转发状态
+// HID 报告队列（UART 任务 → HID 任务）
+// 单生产者/单消费者无锁环形队列：键盘报告按顺序逐个送达，鼠标位移可以合并
+#define HID_QUEUE_LEN 64        // 必须是 2 的幂
+
+typedef enum {
+    HID_ITEM_KEYBOARD,
+    HID_ITEM_MOUSE,
+    HID_ITEM_PROBE,             // 延迟探测标记：前面的报告发送完成后回送给服务器
+} hid_item_kind_t;
+
 typedef struct {
-    uint8_t modifiers;     // 修饰键
-    uint8_t reserved;      // 保留
-    uint8_t keys[6];       // 按键码
-    bool changed;          // 状态变化标志
-} keyboard_state_t;
-
-// 全局共享变量
-static mouse_state_t mouse_state = {0};
-static keyboard_state_t keyboard_state = {0};
-static SemaphoreHandle_t state_mutex;      // 保护共享状态
-static SemaphoreHandle_t hid_update_sem;   // 触发 HID 发送
+    uint8_t kind;               // hid_item_kind_t
+    union {
+        HIDKeyboardBitmap keyboard;  // 键盘状态统一为位图，发送时按主机选择的协议生成报告
+        struct {
+            uint8_t buttons;    // 按键位掩码 (bit0=左, bit1=右, bit2=中)
+            int32_t x;          // X 位移（累积值）
+            int32_t y;          // Y 位移（累积值）
+            int16_t vertical;   // 垂直滚轮（累积值）
+            int16_t horizontal; // 水平滚轮（累积值）
+        } mouse;
+        struct {
+            uint16_t id;        // 服务器的探测序号
+            uint32_t rx_us;     // 解析出探测帧的时间（esp_timer 低 32 位）
+        } probe;
+    };
+} hid_item_t;
+
+static hid_item_t hid_queue[HID_QUEUE_LEN];
+static atomic_uint hid_queue_head;         // 消费者（HID 任务）推进
+static atomic_uint hid_queue_tail;         // 生产者（UART 任务）推进
+static TaskHandle_t hid_task_handle;       // 新报告入队后通知 HID 任务
+static QueueHandle_t uart_event_queue;     // UART 驱动事件（数据到达/溢出）
+
+// 链路状态（仅 UART 任务访问）
+static int link_baud_rate;                 // 当前波特率（可由服务器切换）
+static bool baud_probe_active = false;     // 刚切换波特率，等待新波特率下的第一个有效帧
+static TickType_t baud_probe_deadline;
+
+// 队列统计
+static volatile uint32_t hid_queue_high_water = 0;  // 最大深度
+static atomic_uint hid_queue_merges;               // 合并的报告数（两个任务都会累加）
+static volatile uint32_t hid_queue_overflows = 0;   // 队列满时暂存的次数
+
+// 发送统计
+#define HID_TX_RETRY_MS 10                          // 没有通知时的重试间隔
+static volatile uint32_t hid_tx_reports = 0;        // 已提交给 USB 的报告数
+static volatile uint32_t hid_tx_retries = 0;        // 端点被占用而推迟的提交次数
+static volatile uint32_t hid_tx_drops = 0;          // 主机未连接时丢弃的报告数
+static volatile uint32_t hid_tx_complete_us = 0;    // 最近一次报告发送完成的时间
 
 // 控制状态（LOCAL/REMOTE）
 static volatile bool is_remote_mode = false;
 
 /************* USB HID 描述符 ***************/
 
+// 键盘和鼠标各占一个 HID 接口（需要 CONFIG_TINYUSB_HID_COUNT=2）：
+// 启动协议报告不带报告 ID，键盘必须单独作为启动键盘接口
+enum {
+    ITF_NUM_KEYBOARD,
+    ITF_NUM_MOUSE,
+    ITF_NUM_TOTAL
+};
+
 #define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + CFG_TUD_HID * TUD_HID_DESC_LEN)
 
-// HID 报告描述符：键盘 + 鼠标
-const uint8_t hid_report_descriptor[] = {
-    TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(1)),
-    TUD_HID_REPORT_DESC_MOUSE(HID_REPORT_ID(2))
+// 键盘报告描述符（报告协议，NKRO）：修饰键 8 位 + HID 用途 0x00-0x7F 位图，
+// 与 HIDKeyboardBitmap 的布局相同。主机选择启动协议时改发 8 字节 6KRO 启动报告
+const uint8_t hid_keyboard_report_descriptor[] = {
+    HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ),
+    HID_USAGE      ( HID_USAGE_DESKTOP_KEYBOARD ),
+    HID_COLLECTION ( HID_COLLECTION_APPLICATION ),
+        // 8 位修饰键
+        HID_USAGE_PAGE   ( HID_USAGE_PAGE_KEYBOARD ),
+        HID_USAGE_MIN    ( 224 ),
+        HID_USAGE_MAX    ( 231 ),
+        HID_LOGICAL_MIN  ( 0 ),
+        HID_LOGICAL_MAX  ( 1 ),
+        HID_REPORT_COUNT ( 8 ),
+        HID_REPORT_SIZE  ( 1 ),
+        HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+        // 5 位 LED 输出 + 3 位填充
+        HID_USAGE_PAGE   ( HID_USAGE_PAGE_LED ),
+        HID_USAGE_MIN    ( 1 ),
+        HID_USAGE_MAX    ( 5 ),
+        HID_REPORT_COUNT ( 5 ),
+        HID_REPORT_SIZE  ( 1 ),
+        HID_OUTPUT       ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+        HID_REPORT_COUNT ( 1 ),
+        HID_REPORT_SIZE  ( 3 ),
+        HID_OUTPUT       ( HID_CONSTANT ),
+        // 按键位图：每个用途一位
+        HID_USAGE_PAGE   ( HID_USAGE_PAGE_KEYBOARD ),
+        HID_USAGE_MIN    ( 0 ),
+        HID_USAGE_MAX    ( MSG_KEY_BITMAP_BYTES * 8 - 1 ),
+        HID_LOGICAL_MIN  ( 0 ),
+        HID_LOGICAL_MAX  ( 1 ),
+        HID_REPORT_COUNT ( MSG_KEY_BITMAP_BYTES * 8 ),
+        HID_REPORT_SIZE  ( 1 ),
+        HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+    HID_COLLECTION_END
+};
+
+// 鼠标报告描述符
+const uint8_t hid_mouse_report_descriptor[] = {
+    TUD_HID_REPORT_DESC_MOUSE()
 };
 
 // 字符串描述符
-const char* hid_string_descriptor[5] = {
+const char* hid_string_descriptor[6] = {
     (char[]){0x09, 0x04},  // 语言：英语
     "OneKM",               // 制造商
     "OneKM Device",        // 产品
     "123456",              // 序列号
-    "OneKM HID Interface", // HID 接口
+    "OneKM Keyboard",      // 键盘接口
+    "OneKM Mouse",         // 鼠标接口
 };
 
 // 配置描述符
 static const uint8_t hid_configuration_descriptor[] = {
-    TUD_CONFIG_DESCRIPTOR(1, 1, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
-    TUD_HID_DESCRIPTOR(0, 4, false, sizeof(hid_report_descriptor), 0x81, 16, 10),
+    TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
+    // 轮询间隔 1 ms：全速设备每个帧都可以发送一个报告
+    TUD_HID_DESCRIPTOR(ITF_NUM_KEYBOARD, 4, HID_ITF_PROTOCOL_KEYBOARD,
+                       sizeof(hid_keyboard_report_descriptor), 0x81, 32, 1),
+    TUD_HID_DESCRIPTOR(ITF_NUM_MOUSE, 5, HID_ITF_PROTOCOL_NONE,
+                       sizeof(hid_mouse_report_descriptor), 0x82, 16, 1),
 };
 
 /************* TinyUSB 回调函数 ***************/
 
 uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance)
 {
-    return hid_report_descriptor;
+    return instance == ITF_NUM_KEYBOARD ? hid_keyboard_report_descriptor : hid_mouse_report_descriptor;
+}
+
+// 主机（BIOS、引导程序）可以通过 SET_PROTOCOL 把键盘切到启动协议，
+// 此后键盘报告按 6KRO 启动格式发送，见 tx_submit()
+void tud_hid_set_protocol_cb(uint8_t instance, uint8_t protocol)
+{
+    if (instance == ITF_NUM_KEYBOARD) {
+        ESP_LOGI(TAG, "Keyboard protocol: %s", protocol == HID_PROTOCOL_BOOT ? "boot (6KRO)" : "report (NKRO)");
+    }
 }
 
 uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen)
@@ -102,209 +207,518 @@ void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_
 {
 }
 
-/************* 协议定义（与Linux服务器一致） ***************/
-typedef struct {
-    uint8_t type;          // 消息类型
-    union {
-        struct {
-            int16_t dx;    // 鼠标X位移
-            int16_t dy;    // 鼠标Y位移
-        } mouse_move;
-        struct {
-            uint8_t button; // 鼠标按键（1=左，2=右，3=中）
-            uint8_t state;  // 状态（0=释放，1=按下）
-            uint8_t padding[2]; // 填充
-        } mouse_button;
-        struct {
-            uint8_t modifiers;     // 修饰键位掩码
-            uint8_t reserved;      // 保留（必须为0）
-            uint8_t keys[6];       // 最多6个同时按下的按键
-        } keyboard;
-        struct {
-            uint8_t state;  // 控制状态（0=本地，1=远程）
-            uint8_t padding[3]; // 填充
-        } control;
-        struct {
-            int16_t vertical;   // 垂直滚轮
-            int16_t horizontal; // 水平滚轮
-        } mouse_wheel;
-    } data;
-} __attribute__((packed)) input_message_t;
-
-enum MessageType {
-    MSG_MOUSE_MOVE = 0x01,
-    MSG_MOUSE_BUTTON = 0x02,
-    MSG_KEYBOARD_REPORT = 0x03,
-    MSG_SWITCH = 0x04,
-    MSG_MOUSE_WHEEL = 0x05
-};
+/************* HID 报告队列 ***************/
+// 生产者：只在 UART 任务中调用
+static bool hid_queue_push(const hid_item_t *item)
+{
+    unsigned tail = atomic_load_explicit(&hid_queue_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&hid_queue_head, memory_order_acquire);
+    unsigned depth = tail - head;
+
+    if (depth >= HID_QUEUE_LEN) {
+        return false;
+    }
+    hid_queue[tail % HID_QUEUE_LEN] = *item;
+    atomic_store_explicit(&hid_queue_tail, tail + 1, memory_order_release);
+
+    if (depth + 1 > hid_queue_high_water) {
+        hid_queue_high_water = depth + 1;
+    }
+    return true;
+}
+
+// 消费者：只在 HID 任务中调用。返回 NULL 表示队列为空
+static const hid_item_t *hid_queue_peek(void)
+{
+    unsigned head = atomic_load_explicit(&hid_queue_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&hid_queue_tail, memory_order_acquire);
+    return (head == tail) ? NULL : &hid_queue[head % HID_QUEUE_LEN];
+}
+
+static void hid_queue_pop(void)
+{
+    unsigned head = atomic_load_explicit(&hid_queue_head, memory_order_relaxed);
+    atomic_store_explicit(&hid_queue_head, head + 1, memory_order_release);
+}
+
+// 生产者侧暂存：鼠标位移在按键状态不变时持续合并；队列满时键盘只保留最新状态，
+// 两者按进入暂存的先后顺序入队，保证键盘/鼠标按键的相对顺序
+static hid_item_t pending_mouse = { .kind = HID_ITEM_MOUSE };
+static hid_item_t pending_keyboard = { .kind = HID_ITEM_KEYBOARD };
+static bool mouse_pending = false;
+static bool keyboard_pending = false;
+static bool mouse_first = false;           // 两者都暂存时，鼠标是否先到
+static uint8_t mouse_buttons = 0;          // 当前鼠标按键状态
+
+static void pending_flush(void)
+{
+    if (mouse_pending && (mouse_first || !keyboard_pending)) {
+        if (!hid_queue_push(&pending_mouse)) goto full;
+        mouse_pending = false;
+    }
+    if (keyboard_pending) {
+        if (!hid_queue_push(&pending_keyboard)) goto full;
+        keyboard_pending = false;
+    }
+    if (mouse_pending) {
+        if (!hid_queue_push(&pending_mouse)) goto full;
+        mouse_pending = false;
+    }
+    return;
+
+full:
+    hid_queue_overflows++;
+}
+
+static void pending_mouse_add(uint8_t buttons, int dx, int dy, int vertical, int horizontal)
+{
+    // 按键变化是一个边界：先把旧按键状态下累积的位移入队
+    if (mouse_pending && buttons != pending_mouse.mouse.buttons) {
+        pending_flush();
+    }
+    if (mouse_pending) {
+        // 合并到暂存报告；队列已满时按键状态也只保留最新值
+        pending_mouse.mouse.buttons = buttons;
+        atomic_fetch_add_explicit(&hid_queue_merges, 1, memory_order_relaxed);
+    } else {
+        memset(&pending_mouse.mouse, 0, sizeof(pending_mouse.mouse));
+        pending_mouse.mouse.buttons = buttons;
+        mouse_pending = true;
+        mouse_first = !keyboard_pending;
+    }
+    pending_mouse.mouse.x += dx;
+    pending_mouse.mouse.y += dy;
+    pending_mouse.mouse.vertical += vertical;
+    pending_mouse.mouse.horizontal += horizontal;
+    mouse_buttons = buttons;
+}
+
+static void pending_keyboard_set(const HIDKeyboardBitmap *state)
+{
+    // 每个键盘报告都是一次状态转换：先让之前的数据入队，再排入本报告
+    pending_flush();
+    if (keyboard_pending) {
+        // 队列满：只保留最新的键盘状态
+        atomic_fetch_add_explicit(&hid_queue_merges, 1, memory_order_relaxed);
+    } else {
+        keyboard_pending = true;
+        if (mouse_pending) mouse_first = true;
+    }
+    pending_keyboard.keyboard = *state;
+    pending_flush();
+}
+
+/************* UART 消息处理 ***************/
+// 向服务器发送一帧。UART0 同时输出控制台日志，帧前加分隔符与日志文本隔开
+static void link_send(const Message *msg)
+{
+    uint8_t buf[1 + MSG_FRAME_MAX];
+    buf[0] = MSG_FRAME_DELIM;
+    size_t len = msg_frame_encode(msg, buf + 1);
+    uart_write_bytes(UART_NUM, buf, len + 1);
+}
+
+static void handle_set_baud(uint32_t rate)
+{
+    Message reply;
+
+    if (rate < UART_BAUD_MIN || rate > UART_BAUD_MAX) {
+        // 回送当前波特率表示拒绝
+        msg_set_baud(&reply, (uint32_t)link_baud_rate);
+        link_send(&reply);
+        ESP_LOGW(TAG, "Rejected baud rate %lu", (unsigned long)rate);
+        return;
+    }
+
+    // 以原波特率确认，发送完毕后再切换
+    msg_set_baud(&reply, rate);
+    link_send(&reply);
+    uart_wait_tx_done(UART_NUM, pdMS_TO_TICKS(50));
+    uart_set_baudrate(UART_NUM, rate);
+    link_baud_rate = (int)rate;
+
+    // 回到启动波特率不需要确认；其他波特率若服务器那边无法工作则自动恢复
+    baud_probe_active = (link_baud_rate != UART_BAUD_RATE);
+    baud_probe_deadline = xTaskGetTickCount() + pdMS_TO_TICKS(UART_BAUD_PROBE_MS);
+    ESP_LOGI(TAG, "Baud rate switched to %d", link_baud_rate);
+}
+
+static void handle_message(const Message *msg)
+{
+    switch (msg->type) {
+        case MSG_MOUSE_MOVE:
+            pending_mouse_add(mouse_buttons, msg->data.mouse_move.dx, msg->data.mouse_move.dy, 0, 0);
+            ESP_LOGD(TAG, "Mouse move: dx=%d, dy=%d",
+                     msg->data.mouse_move.dx, msg->data.mouse_move.dy);
+            break;
+
+        case MSG_MOUSE_BUTTON: {
+            uint8_t buttons = mouse_buttons;
+            if (msg->data.mouse_button.state) {
+                buttons |= (1 << (msg->data.mouse_button.button - 1));
+            } else {
+                buttons &= ~(1 << (msg->data.mouse_button.button - 1));
+            }
+            pending_mouse_add(buttons, 0, 0, 0, 0);
+            ESP_LOGD(TAG, "Mouse button: button=%d, state=%d",
+                     msg->data.mouse_button.button, msg->data.mouse_button.state);
+            break;
+        }
+
+        case MSG_MOUSE_WHEEL:
+            pending_mouse_add(mouse_buttons, 0, 0,
+                              msg->data.mouse_wheel.vertical, msg->data.mouse_wheel.horizontal);
+            ESP_LOGD(TAG, "Mouse wheel: vertical=%d, horizontal=%d",
+                     msg->data.mouse_wheel.vertical, msg->data.mouse_wheel.horizontal);
+            break;
+
+        case MSG_MOUSE_REPORT:
+            // 一个输入帧的完整鼠标状态：按键直接覆盖，位移和滚轮累积
+            pending_mouse_add(msg->data.mouse_report.buttons,
+                              msg->data.mouse_report.dx, msg->data.mouse_report.dy,
+                              msg->data.mouse_report.vertical, msg->data.mouse_report.horizontal);
+            ESP_LOGD(TAG, "Mouse report: buttons=0x%x dx=%d dy=%d v=%d h=%d",
+                     msg->data.mouse_report.buttons,
+                     msg->data.mouse_report.dx, msg->data.mouse_report.dy,
+                     msg->data.mouse_report.vertical, msg->data.mouse_report.horizontal);
+            break;
+
+        case MSG_KEYBOARD_REPORT: {
+            // 键盘报告按顺序入队，快速的按下/释放不会被覆盖
+            HIDKeyboardBitmap state;
+            msg_report_to_bitmap(&msg->data.keyboard, &state);
+            pending_keyboard_set(&state);
+            ESP_LOGD(TAG, "Keyboard report: mod=0x%02X, keys=%d,%d,%d,%d,%d,%d",
+                     msg->data.keyboard.modifiers,
+                     msg->data.keyboard.keys[0], msg->data.keyboard.keys[1],
+                     msg->data.keyboard.keys[2], msg->data.keyboard.keys[3],
+                     msg->data.keyboard.keys[4], msg->data.keyboard.keys[5]);
+            break;
+        }
+
+        case MSG_KEYBOARD_BITMAP:
+            pending_keyboard_set(&msg->data.keyboard_bitmap);
+            ESP_LOGD(TAG, "Keyboard bitmap: mod=0x%02X", msg->data.keyboard_bitmap.modifiers);
+            break;
+
+        case MSG_SWITCH:
+            is_remote_mode = (msg->data.control.state == 1);
+            ESP_LOGI(TAG, "Mode switched: %s", is_remote_mode ? "REMOTE" : "LOCAL");
+
+            // 丢弃尚未入队的鼠标位移（按键状态保留，由服务器负责释放）
+            if (mouse_pending) {
+                pending_mouse.mouse.x = 0;
+                pending_mouse.mouse.y = 0;
+                pending_mouse.mouse.vertical = 0;
+                pending_mouse.mouse.horizontal = 0;
+            }
+
+            // LED 指示
+            if (is_remote_mode) {
+                gpio_set_level(GPIO_NUM_48, 1);
+            } else {
+                gpio_set_level(GPIO_NUM_48, 0);
+            }
+            break;
+
+        case MSG_HELLO: {
+            Message reply;
+            msg_hello_ack(&reply, LINK_FEATURES, UART_BAUD_MAX, HID_QUEUE_LEN);
+            link_send(&reply);
+            ESP_LOGI(TAG, "Handshake: server protocol v%d, features 0x%04x",
+                     msg->data.hello.version, msg->data.hello.features);
+            break;
+        }
+
+        case MSG_SET_BAUD:
+            handle_set_baud(msg->data.baud.rate);
+            break;
+
+        case MSG_LATENCY_PROBE: {
+            // 探测标记排在它之前的输入之后；无法保持顺序时（队列满）丢弃
+            hid_item_t item = { .kind = HID_ITEM_PROBE };
+            item.probe.id = msg->data.probe.id;
+            item.probe.rx_us = (uint32_t)esp_timer_get_time();
+            pending_flush();
+            if (!mouse_pending && !keyboard_pending) {
+                hid_queue_push(&item);
+            }
+            break;
+        }
+
+        default:
+            ESP_LOGW(TAG, "Unknown message type: %d", msg->type);
+            break;
+    }
+}
 
 /************* UART 接收任务 ***************/
+// 回到启动波特率。服务器只会在确认固件是 v2 之后才使用其他波特率；
+// 上次会话异常退出时，服务器仍以启动波特率握手，由固件在这里退回
+static void revert_baud(MsgParser *parser, const char *why)
+{
+    baud_probe_active = false;
+    uart_set_baudrate(UART_NUM, UART_BAUD_RATE);
+    link_baud_rate = UART_BAUD_RATE;
+    uart_flush_input(UART_NUM);
+    msg_parser_init(parser);
+    ESP_LOGW(TAG, "%s, reverted to %d baud", why, UART_BAUD_RATE);
+}
+
 static void uart_receive_task(void *pvParameters)
 {
     uint8_t data[UART_BUF_SIZE];
-    input_message_t msg;
-    size_t bytes_received = 0;
-
+    MsgParser parser;
+    Message msg;
+    uart_event_t event;
+    uint32_t frames_bad_logged = 0;
+    uint32_t rx_overflows = 0;
+    uint32_t garbled = 0;                  // 上一个有效帧之后的帧错误/坏帧次数
+    unsigned notified_tail = 0;
+
+    msg_parser_init(&parser);
     ESP_LOGI(TAG, "UART receive task started");
 
     while (1) {
-        // 读取 UART 数据
-        int len = uart_read_bytes(UART_NUM, data, sizeof(data), 10 / portTICK_PERIOD_MS);
+        // 阻塞等待驱动事件：FIFO 达到阈值或 RX 超时（最后一个字节后约两个字符时间）时到达，
+        // 不再按 tick 轮询。刚切换波特率时最多等到确认期限
+        TickType_t wait = portMAX_DELAY;
+        if (baud_probe_active) {
+            TickType_t now = xTaskGetTickCount();
+            wait = (TickType_t)(baud_probe_deadline - now);
+            if ((int32_t)wait <= 0) {
+                // 新波特率下一直没有收到有效帧：恢复启动波特率
+                revert_baud(&parser, "No frames at new baud rate");
+                frames_bad_logged = 0;
+                garbled = 0;
+                continue;
+            }
+        }
+        if (xQueueReceive(uart_event_queue, &event, wait) != pdTRUE) {
+            continue;
+        }
+
+        switch (event.type) {
+            case UART_DATA:
+                break;
+
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                // 数据已丢失：清空缓冲区，解析器在下一个帧分隔符处重新同步
+                uart_flush_input(UART_NUM);
+                xQueueReset(uart_event_queue);
+                msg_parser_init(&parser);
+                ESP_LOGW(TAG, "UART RX overflow (%lu)", (unsigned long)++rx_overflows);
+                continue;
+
+            case UART_FRAME_ERR:
+            case UART_PARITY_ERR:
+            case UART_BREAK:
+                // 以较低波特率发送的字节在这里表现为帧错误和 break
+                if (link_baud_rate != UART_BAUD_RATE && ++garbled >= UART_GARBLED_LIMIT) {
+                    revert_baud(&parser, "Line garbled at switched baud rate");
+                    garbled = 0;
+                    frames_bad_logged = 0;
+                }
+                continue;
 
-        if (len > 0) {
+            default:
+                continue;
+        }
+
+        // 一次取完驱动缓冲区中的全部数据（包括处理期间新到的），逐个解析并应用
+        int len;
+        while ((len = uart_read_bytes(UART_NUM, data, sizeof(data), 0)) > 0) {
             for (int i = 0; i < len; i++) {
-                // 累加字节到消息缓冲区
-                ((uint8_t*)&msg)[bytes_received++] = data[i];
-
-                // 如果接收到了完整的消息
-                if (bytes_received == sizeof(input_message_t)) {
-                    // 处理消息
-                    switch (msg.type) {
-                        case MSG_MOUSE_MOVE:
-                            xSemaphoreTake(state_mutex, portMAX_DELAY);
-                            // 累积鼠标移动（不移除int16_t转换，直接累积）
-                            mouse_state.x += msg.data.mouse_move.dx;
-                            mouse_state.y += msg.data.mouse_move.dy;
-                            mouse_state.changed = true;
-                            xSemaphoreGive(state_mutex);
-                            xSemaphoreGive(hid_update_sem);
-                            ESP_LOGD(TAG, "Mouse move: dx=%d, dy=%d, accumulated: x=%d, y=%d",
-                                     msg.data.mouse_move.dx, msg.data.mouse_move.dy,
-                                     mouse_state.x, mouse_state.y);
-                            break;
-
-                        case MSG_MOUSE_BUTTON:
-                            xSemaphoreTake(state_mutex, portMAX_DELAY);
-                            if (msg.data.mouse_button.state) {
-                                mouse_state.buttons |= (1 << (msg.data.mouse_button.button - 1));
-                            } else {
-                                mouse_state.buttons &= ~(1 << (msg.data.mouse_button.button - 1));
-                            }
-                            mouse_state.changed = true;
-                            xSemaphoreGive(state_mutex);
-                            xSemaphoreGive(hid_update_sem);
-                            ESP_LOGD(TAG, "Mouse button: button=%d, state=%d",
-                                     msg.data.mouse_button.button, msg.data.mouse_button.state);
-                            break;
-
-                        case MSG_MOUSE_WHEEL:
-                            xSemaphoreTake(state_mutex, portMAX_DELAY);
-                            // Accumulate wheel movement
-                            mouse_state.vertical_wheel += msg.data.mouse_wheel.vertical;
-                            mouse_state.horizontal_wheel += msg.data.mouse_wheel.horizontal;
-                            mouse_state.changed = true;
-                            xSemaphoreGive(state_mutex);
-                            xSemaphoreGive(hid_update_sem);
-                            ESP_LOGI(TAG, "[RECV] MOUSE_WHEEL vertical=%d, horizontal=%d, accumulated: v=%d, h=%d",
-                                     msg.data.mouse_wheel.vertical, msg.data.mouse_wheel.horizontal,
-                                     mouse_state.vertical_wheel, mouse_state.horizontal_wheel);
-                            break;
-
-                        case MSG_KEYBOARD_REPORT:
-                            // 直接复制键盘报告
-                            xSemaphoreTake(state_mutex, portMAX_DELAY);
-                            memcpy(&keyboard_state, &msg.data.keyboard, sizeof(keyboard_state_t) - sizeof(bool));
-                            keyboard_state.changed = true;
-                            xSemaphoreGive(state_mutex);
-                            xSemaphoreGive(hid_update_sem);
-                            ESP_LOGD(TAG, "Keyboard report: mod=0x%02X, keys=%d,%d,%d,%d,%d,%d",
-                                     msg.data.keyboard.modifiers,
-                                     msg.data.keyboard.keys[0], msg.data.keyboard.keys[1],
-                                     msg.data.keyboard.keys[2], msg.data.keyboard.keys[3],
-                                     msg.data.keyboard.keys[4], msg.data.keyboard.keys[5]);
-                            break;
-
-                        case MSG_SWITCH:
-                            is_remote_mode = (msg.data.control.state == 1);
-                            ESP_LOGI(TAG, "Mode switched: %s", is_remote_mode ? "REMOTE" : "LOCAL");
-
-                            // 重置鼠标状态（清除累积的移动数据）
-                            xSemaphoreTake(state_mutex, portMAX_DELAY);
-                            mouse_state.x = 0;
-                            mouse_state.y = 0;
-                            mouse_state.vertical_wheel = 0;
-                            mouse_state.horizontal_wheel = 0;
-                            mouse_state.changed = false;
-                            xSemaphoreGive(state_mutex);
-
-                            // LED 指示
-                            if (is_remote_mode) {
-                                gpio_set_level(GPIO_NUM_48, 1);
-                            } else {
-                                gpio_set_level(GPIO_NUM_48, 0);
-                            }
-                            break;
-
-                        default:
-                            ESP_LOGW(TAG, "Unknown message type: %d", msg.type);
-                            break;
+                // 按帧解析：损坏的帧只丢弃自身，下一个分隔符后立即重新同步
+                if (msg_parser_feed(&parser, data[i], &msg)) {
+                    baud_probe_active = false;   // 新波特率工作正常
+                    garbled = 0;
+                    handle_message(&msg);
+                } else if (data[i] == MSG_FRAME_DELIM && parser.frames_bad != frames_bad_logged) {
+                    frames_bad_logged = parser.frames_bad;
+                    if (link_baud_rate != UART_BAUD_RATE && ++garbled >= UART_GARBLED_LIMIT) {
+                        revert_baud(&parser, "Only corrupt frames at switched baud rate");
+                        garbled = 0;
+                        frames_bad_logged = 0;
+                        break;
                     }
-
-                    bytes_received = 0; // 重置接收缓冲区
+                    ESP_LOGW(TAG, "Dropped corrupt frame (ok=%lu, bad=%lu)",
+                             (unsigned long)parser.frames_ok, (unsigned long)parser.frames_bad);
                 }
             }
         }
+
+        // 本批数据处理完：合并后的鼠标位移入队，并只唤醒 HID 任务一次
+        pending_flush();
+        unsigned tail = atomic_load_explicit(&hid_queue_tail, memory_order_relaxed);
+        if (tail != notified_tail) {
+            notified_tail = tail;
+            xTaskNotifyGive(hid_task_handle);
+        }
     }
 }
 
 /************* HID 发送任务 ***************/
-static void hid_send_task(void *pvParameters)
+static int8_t clamp_int8(int32_t v)
 {
-    ESP_LOGI(TAG, "HID send task started");
+    return (int8_t)(v > 127 ? 127 : (v < -128 ? -128 : v));
+}
 
-    while (1) {
-        // 等待信号量（由 UART 任务触发）
-        if (xSemaphoreTake(hid_update_sem, portMAX_DELAY) == pdTRUE) {
-            // 获取互斥锁，读取状态
-            xSemaphoreTake(state_mutex, portMAX_DELAY);
+// 发送调度：端点被占用时 tud_hid_n_report() 会失败。当前报告在被 TinyUSB
+// 接受之前一直保留在 tx_item 中，端点空闲（tud_hid_report_complete_cb 通知或
+// hid_ready()）时再提交下一个。键盘和鼠标虽然各有一个 IN 端点，仍然一次只
+// 提交一个报告，主机看到的键盘/鼠标顺序与服务器发送的顺序一致。
+static hid_item_t tx_item;
+static bool tx_valid = false;
+static HIDKeyboardReport boot_report;     // 启动协议下最近生成的 6KRO 报告
 
-            bool kb_changed = keyboard_state.changed;
-            bool mouse_changed = mouse_state.changed;
+static bool hid_ready(void)
+{
+    return tud_hid_n_ready(ITF_NUM_KEYBOARD) && tud_hid_n_ready(ITF_NUM_MOUSE);
+}
 
-            keyboard_state_t kb_local = keyboard_state;
-            mouse_state_t mouse_local = mouse_state;
+// 从队列取出下一个报告，或把排在后面、按键状态相同的鼠标报告并入当前报告
+static bool tx_load(void)
+{
+    const hid_item_t *next;
 
-            // 清除变化标志
-            keyboard_state.changed = false;
-            mouse_state.changed = false;
+    if (!tx_valid) {
+        if ((next = hid_queue_peek()) == NULL) {
+            return false;
+        }
+        tx_item = *next;
+        tx_valid = true;
+        hid_queue_pop();
+    }
 
-            xSemaphoreGive(state_mutex);
+    // 等待端点期间到达的位移都并入同一个报告，每个 USB 帧携带尽可能多的数据
+    while (tx_item.kind == HID_ITEM_MOUSE &&
+           (next = hid_queue_peek()) != NULL &&
+           next->kind == HID_ITEM_MOUSE &&
+           next->mouse.buttons == tx_item.mouse.buttons) {
+        tx_item.mouse.x += next->mouse.x;
+        tx_item.mouse.y += next->mouse.y;
+        tx_item.mouse.vertical += next->mouse.vertical;
+        tx_item.mouse.horizontal += next->mouse.horizontal;
+        hid_queue_pop();
+        atomic_fetch_add_explicit(&hid_queue_merges, 1, memory_order_relaxed);
+    }
+    return true;
+}
 
-            // 发送键盘事件
-            if (kb_changed) {
-                tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD,
-                    kb_local.modifiers, kb_local.keys);
-                ESP_LOGV(TAG, "Sent keyboard report");
+// 提交 tx_item（鼠标报告一次只能携带 int8 位移/滚轮，剩余部分留到下一帧）
+static bool tx_submit(void)
+{
+    if (tx_item.kind == HID_ITEM_KEYBOARD) {
+        if (tud_hid_n_get_protocol(ITF_NUM_KEYBOARD) == HID_PROTOCOL_BOOT) {
+            // 启动协议只有 6 个按键槽：已按下的键保持原位，多出的键等有空位时再报告
+            msg_bitmap_to_report(&tx_item.keyboard, &boot_report);
+            if (!tud_hid_n_keyboard_report(ITF_NUM_KEYBOARD, 0,
+                                           boot_report.modifiers, boot_report.keys)) {
+                return false;
             }
+        } else if (!tud_hid_n_report(ITF_NUM_KEYBOARD, 0,
+                                     &tx_item.keyboard, sizeof(tx_item.keyboard))) {
+            return false;
+        }
+        ESP_LOGV(TAG, "Sent keyboard report");
+        tx_valid = false;
+        return true;
+    }
 
-            // 发送鼠标事件
-            if (mouse_changed) {
-                // 将int16_t转换为int8_t（TinyUSB API需要int8_t）
-                int8_t dx = (int8_t)(mouse_local.x > 127 ? 127 : (mouse_local.x < -128 ? -128 : mouse_local.x));
-                int8_t dy = (int8_t)(mouse_local.y > 127 ? 127 : (mouse_local.y < -128 ? -128 : mouse_local.y));
-                // 滚轮直接使用int8_t值（无需转换）
-                int8_t vertical_wheel = mouse_local.vertical_wheel;
-                int8_t horizontal_wheel = mouse_local.horizontal_wheel;
-
-                tud_hid_mouse_report(HID_ITF_PROTOCOL_MOUSE,
-                    mouse_local.buttons, dx, dy, vertical_wheel, horizontal_wheel);
-                ESP_LOGI(TAG, "[SEND] HID_MOUSE_REPORT buttons=0x%x dx=%d dy=%d wheel_v=%d wheel_h=%d",
-                         mouse_local.buttons, dx, dy, vertical_wheel, horizontal_wheel);
-
-                // 减去已发送的值（保留未发送的部分）
-                xSemaphoreTake(state_mutex, portMAX_DELAY);
-                mouse_state.x -= dx;
-                mouse_state.y -= dy;
-                mouse_state.vertical_wheel = 0;
-                mouse_state.horizontal_wheel = 0;
-                // 如果已经发送完所有累积值，清除changed标志
-                if ((mouse_state.x == 0 && mouse_state.y == 0) || !is_remote_mode) {
-                    mouse_state.changed = false;
-                }
-                xSemaphoreGive(state_mutex);
-            }
+    int8_t dx = clamp_int8(tx_item.mouse.x);
+    int8_t dy = clamp_int8(tx_item.mouse.y);
+    int8_t wv = clamp_int8(tx_item.mouse.vertical);
+    int8_t wh = clamp_int8(tx_item.mouse.horizontal);
+
+    if (!tud_hid_n_mouse_report(ITF_NUM_MOUSE, 0, tx_item.mouse.buttons, dx, dy, wv, wh)) {
+        return false;
+    }
+    ESP_LOGD(TAG, "[SEND] HID_MOUSE_REPORT buttons=0x%x dx=%d dy=%d wheel_v=%d wheel_h=%d",
+             tx_item.mouse.buttons, dx, dy, wv, wh);
+    tx_item.mouse.x -= dx;
+    tx_item.mouse.y -= dy;
+    tx_item.mouse.vertical -= wv;
+    tx_item.mouse.horizontal -= wh;
+    tx_valid = (tx_item.mouse.x != 0 || tx_item.mouse.y != 0 ||
+                tx_item.mouse.vertical != 0 || tx_item.mouse.horizontal != 0);
+    return true;
+}
+
+// 回送延迟探测：固件侧耗时为收到探测帧到承载它的报告发送完成。
+// 探测到达前报告就已发完（前面没有待发送的输入）时，只计排队时间
+static void probe_echo(const hid_item_t *item)
+{
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    uint32_t done = hid_tx_complete_us;
+    if ((int32_t)(done - item->probe.rx_us) < 0) {
+        done = now;
+    }
+
+    Message msg;
+    msg_latency_probe(&msg, item->probe.id, done - item->probe.rx_us);
+    link_send(&msg);
+}
+
+// 端点空闲时提交下一个报告
+static void tx_pump(void)
+{
+    if (!tud_mounted()) {
+        // 主机未连接：丢弃积压的报告，避免连接后回放过期输入
+        if (tx_valid) {
+            tx_valid = false;
+            hid_tx_drops++;
+        }
+        while (hid_queue_peek() != NULL) {
+            hid_queue_pop();
+            hid_tx_drops++;
+        }
+        return;
+    }
+
+    if (tud_suspended()) {
+        // 有输入时唤醒主机，报告保留到恢复后再发
+        if (tx_valid || hid_queue_peek() != NULL) {
+            tud_remote_wakeup();
+        }
+        return;
+    }
+
+    while (hid_ready() && tx_load()) {
+        if (tx_item.kind == HID_ITEM_PROBE) {
+            // 端点空闲说明它之前的报告都已发送完成
+            probe_echo(&tx_item);
+            tx_valid = false;
+            continue;
         }
+        if (tx_submit()) {
+            hid_tx_reports++;
+        } else {
+            hid_tx_retries++;   // 端点被占用，等待完成回调后重试
+        }
+        break;
+    }
+}
+
+// 上一个报告已发给主机（TinyUSB 任务上下文）：唤醒 HID 任务提交下一个
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const* report, uint16_t len)
+{
+    hid_tx_complete_us = (uint32_t)esp_timer_get_time();
+    if (hid_task_handle != NULL) {
+        xTaskNotifyGive(hid_task_handle);
+    }
+}
+
+static void hid_send_task(void *pvParameters)
+{
+    ESP_LOGI(TAG, "HID send task started");
+
+    while (1) {
+        // 由 UART 任务（新报告）或完成回调（端点空闲）唤醒；
+        // 超时兜底，防止错过通知或挂起恢复后报告滞留
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HID_TX_RETRY_MS));
+        tx_pump();
     }
 }
 
@@ -342,13 +756,21 @@ void app_main(void)
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
+#if CONFIG_ONEKM_UART_FLOW_CONTROL
+        .flow_ctrl = UART_HW_FLOWCTRL_CTS_RTS,
+        .rx_flow_ctrl_thresh = UART_RX_FLOW_THRESH,
+#else
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+#endif
         .source_clk = UART_SCLK_DEFAULT,
     };
 
     // 安装 UART 驱动
-    ESP_ERROR_CHECK(uart_driver_install(UART_NUM, UART_BUF_SIZE * 2, UART_BUF_SIZE * 2, 0, NULL, 0));
+    ESP_ERROR_CHECK(uart_driver_install(UART_NUM, UART_RX_RING_SIZE, UART_BUF_SIZE * 2,
+                                        UART_EVENT_QUEUE_LEN, &uart_event_queue, 0));
     ESP_ERROR_CHECK(uart_param_config(UART_NUM, &uart_config));
+    ESP_ERROR_CHECK(uart_set_rx_timeout(UART_NUM, UART_RX_TIMEOUT_SYMBOLS));
+    link_baud_rate = UART_BAUD_RATE;
 
     // 手动设置引脚映射（绕过默认的 USB CDC 映射）
     esp_rom_gpio_connect_out_signal(UART_TX_PIN, UART_PERIPH_SIGNAL(0, SOC_UART_TX_PIN_IDX), false, false);
@@ -358,16 +780,14 @@ void app_main(void)
     gpio_set_direction(UART_TX_PIN, GPIO_MODE_OUTPUT);
     gpio_set_direction(UART_RX_PIN, GPIO_MODE_INPUT);
 
-    ESP_LOGI(TAG, "UART0 initialized: baud=%d, TX=GPIO%d, RX=GPIO%d", UART_BAUD_RATE, UART_TX_PIN, UART_RX_PIN);
-
-    // 3. 创建信号量和互斥锁
-    state_mutex = xSemaphoreCreateMutex();
-    hid_update_sem = xSemaphoreCreateBinary();
+#if CONFIG_ONEKM_UART_FLOW_CONTROL
+    ESP_ERROR_CHECK(uart_set_pin(UART_NUM, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE,
+                                 CONFIG_ONEKM_UART_RTS_PIN, CONFIG_ONEKM_UART_CTS_PIN));
+    ESP_LOGI(TAG, "UART0 flow control: RTS=GPIO%d, CTS=GPIO%d",
+             CONFIG_ONEKM_UART_RTS_PIN, CONFIG_ONEKM_UART_CTS_PIN);
+#endif
 
-    if (state_mutex == NULL || hid_update_sem == NULL) {
-        ESP_LOGE(TAG, "Failed to create semaphore/mutex");
-        return;
-    }
+    ESP_LOGI(TAG, "UART0 initialized: baud=%d, TX=GPIO%d, RX=GPIO%d", UART_BAUD_RATE, UART_TX_PIN, UART_RX_PIN);
 
     // 4. 初始化 USB
     ESP_LOGI(TAG, "USB initialization");
@@ -384,26 +804,26 @@ void app_main(void)
     ESP_LOGI(TAG, "USB initialization DONE");
 
     // 5. 创建任务
-    // UART 接收任务（Core 0）
+    // HID 发送任务（Core 1）——先创建，UART 任务需要它的句柄来发送通知
     xTaskCreatePinnedToCore(
-        uart_receive_task,      // 任务函数
-        "uart_receive",         // 任务名
+        hid_send_task,          // 任务函数
+        "hid_send",             // 任务名
         4096,                   // 堆栈大小
         NULL,                   // 参数
         5,                      // 优先级
-        NULL,                   // 任务句柄
-        0                       // Core 0
+        &hid_task_handle,       // 任务句柄
+        1                       // Core 1
     );
 
-    // HID 发送任务（Core 1）
+    // UART 接收任务（Core 0）
     xTaskCreatePinnedToCore(
-        hid_send_task,          // 任务函数
-        "hid_send",             // 任务名
+        uart_receive_task,      // 任务函数
+        "uart_receive",         // 任务名
         4096,                   // 堆栈大小
         NULL,                   // 参数
         5,                      // 优先级
         NULL,                   // 任务句柄
-        1                       // Core 1
+        0                       // Core 0
     );
 
     ESP_LOGI(TAG, "All tasks created");
@@ -437,6 +857,29 @@ void app_main(void)
             vTaskDelay(pdMS_TO_TICKS(500)); // 防抖
         }
 
+        // 队列/发送统计（有变化时最多每 10 秒输出一次）
+        static int stats_counter = 0;
+        static uint32_t last_merges = 0, last_overflows = 0;
+        static uint32_t last_retries = 0, last_drops = 0;
+        if (++stats_counter >= 100) {
+            stats_counter = 0;
+            uint32_t merges = atomic_load_explicit(&hid_queue_merges, memory_order_relaxed);
+            if (merges != last_merges || hid_queue_overflows != last_overflows) {
+                last_merges = merges;
+                last_overflows = hid_queue_overflows;
+                ESP_LOGI(TAG, "HID queue: high_water=%lu/%d merges=%lu overflows=%lu",
+                         (unsigned long)hid_queue_high_water, HID_QUEUE_LEN,
+                         (unsigned long)last_merges, (unsigned long)last_overflows);
+            }
+            if (hid_tx_retries != last_retries || hid_tx_drops != last_drops) {
+                last_retries = hid_tx_retries;
+                last_drops = hid_tx_drops;
+                ESP_LOGI(TAG, "HID tx: reports=%lu retries=%lu drops=%lu",
+                         (unsigned long)hid_tx_reports, (unsigned long)last_retries,
+                         (unsigned long)last_drops);
+            }
+        }
+
         vTaskDelay(pdMS_TO_TICKS(100));
     }
 }
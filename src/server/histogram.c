@@ -0,0 +1,74 @@
+#include "histogram.h"
+#include <stdio.h>
+#include <string.h>
+
+static unsigned bucket_of(uint32_t us) {
+    if (us < 16) return us;
+    unsigned octave = 31u - (unsigned)__builtin_clz(us);   /* >= 4 */
+    unsigned sub = (us >> (octave - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1);
+    return 16 + ((octave - 4) << HIST_SUB_BITS) + sub;
+}
+
+static uint32_t bucket_upper(unsigned i) {
+    if (i < 16) return i;
+    unsigned octave = 4 + ((i - 16) >> HIST_SUB_BITS);
+    unsigned sub = (i - 16) & ((1u << HIST_SUB_BITS) - 1);
+    uint64_t width = 1ull << (octave - HIST_SUB_BITS);
+    uint64_t upper = ((uint64_t)((1u << HIST_SUB_BITS) + sub) << (octave - HIST_SUB_BITS)) + width - 1;
+    return upper > UINT32_MAX ? UINT32_MAX : (uint32_t)upper;
+}
+
+void hist_reset(Histogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+/* Single writer: plain read-modify-write, but each counter is published
+ * with a relaxed atomic store so hist_merge() may read it from another
+ * thread. On x86 and ARM these compile to ordinary loads and stores. */
+#define BUMP(field, by) \
+    __atomic_store_n(&(field), (field) + (by), __ATOMIC_RELAXED)
+
+void hist_add(Histogram *h, uint64_t us) {
+    uint32_t v = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    BUMP(h->buckets[bucket_of(v)], 1);
+    BUMP(h->count, 1);
+    BUMP(h->sum, v);
+    if (v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+void hist_merge(Histogram *dst, const Histogram *src) {
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum   += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint32_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max) dst->max = max;
+}
+
+uint32_t hist_percentile(const Histogram *h, double p) {
+    if (h->count == 0) return 0;
+
+    uint64_t rank = (uint64_t)((double)h->count * p / 100.0 + 0.5);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint32_t upper = bucket_upper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+void hist_print(const char *label, const Histogram *h) {
+    if (h->count == 0) {
+        printf("  %-12s no samples\n", label);
+        return;
+    }
+    printf("  %-12s n=%-8llu p50=%-7u p99=%-7u max=%-7u mean=%.0f us\n", label,
+           (unsigned long long)h->count, hist_percentile(h, 50), hist_percentile(h, 99),
+           h->max, (double)h->sum / (double)h->count);
+}
@@ -0,0 +1,34 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Log-linear latency histogram in microseconds: exact below 16 us, then
+ * 8 buckets per power of two (at most 12.5% error), up to ~4000 s. */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS  (16 + (32 - 4) * (1 << HIST_SUB_BITS))
+
+typedef struct {
+    uint32_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint32_t max;
+} Histogram;
+
+void     hist_reset(Histogram *h);
+
+/* Only one thread may add to a given histogram. */
+void     hist_add(Histogram *h, uint64_t us);
+
+/* Add src's samples into dst. src may be live in another thread's
+ * hist_add(): the snapshot is torn across counters, never within one. */
+void     hist_merge(Histogram *dst, const Histogram *src);
+
+/* Upper bound of the bucket holding the p-th percentile (0 < p <= 100),
+ * capped at the recorded maximum. 0 if the histogram is empty. */
+uint32_t hist_percentile(const Histogram *h, double p);
+
+/* One line: count, p50, p99, max and mean. */
+void     hist_print(const char *label, const Histogram *h);
+
+#endif // HISTOGRAM_H
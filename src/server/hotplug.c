@@ -39,6 +39,53 @@ int hotplug_get_fd(void) {
     return udev_mon ? udev_monitor_get_fd(udev_mon) : -1;
 }
 
+static int property_is_1(struct udev_device *dev, const char *key) {
+    const char *value = udev_device_get_property_value(dev, key);
+    return value && strcmp(value, "1") == 0;
+}
+
+/* Classified by udev's input_id builtin; power buttons, lid switches,
+ * touchpads etc. are left alone */
+static int is_keyboard_or_mouse(struct udev_device *dev) {
+    return property_is_1(dev, "ID_INPUT_KEYBOARD") || property_is_1(dev, "ID_INPUT_MOUSE");
+}
+
+static int is_event_node(const char *devnode) {
+    return devnode && strncmp(devnode, "/dev/input/event", 16) == 0;
+}
+
+int hotplug_enumerate(void) {
+    if (!udev_ctx || !on_add) return -1;
+
+    struct udev_enumerate *en = udev_enumerate_new(udev_ctx);
+    if (!en) return -1;
+    udev_enumerate_add_match_subsystem(en, "input");
+    udev_enumerate_add_match_property(en, "ID_INPUT_KEYBOARD", "1");
+    udev_enumerate_add_match_property(en, "ID_INPUT_MOUSE", "1");
+    if (udev_enumerate_scan_devices(en) < 0) {
+        udev_enumerate_unref(en);
+        return -1;
+    }
+
+    int count = 0;
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(en)) {
+        struct udev_device *dev =
+            udev_device_new_from_syspath(udev_ctx, udev_list_entry_get_name(entry));
+        if (!dev) continue;
+        const char *devnode = udev_device_get_devnode(dev);
+        if (is_event_node(devnode)) {
+            on_add(devnode);
+            count++;
+        }
+        udev_device_unref(dev);
+    }
+    udev_enumerate_unref(en);
+
+    printf("[HOTPLUG] udev lists %d keyboard/mouse node(s)\n", count);
+    return count;
+}
+
 void hotplug_process(void) {
     if (!udev_mon) return;
 
@@ -48,8 +95,8 @@ void hotplug_process(void) {
     const char *action  = udev_device_get_action(dev);
     const char *devnode = udev_device_get_devnode(dev);
 
-    if (action && devnode && strncmp(devnode, "/dev/input/event", 16) == 0) {
-        if (strcmp(action, "add") == 0 && on_add) {
+    if (action && is_event_node(devnode)) {
+        if (strcmp(action, "add") == 0 && on_add && is_keyboard_or_mouse(dev)) {
             on_add(devnode);
         } else if (strcmp(action, "remove") == 0 && on_remove) {
             on_remove(devnode);
@@ -72,8 +119,9 @@ int hotplug_init(hotplug_add_cb add_cb, hotplug_remove_cb remove_cb) {
     printf("[HOTPLUG] Disabled (libudev not available — install libudev-dev for hotplug support)\n");
     return -1;
 }
-int  hotplug_get_fd(void)   { return -1; }
-void hotplug_process(void)  {}
-void hotplug_cleanup(void)  {}
+int  hotplug_get_fd(void)    { return -1; }
+int  hotplug_enumerate(void) { return -1; }
+void hotplug_process(void)   {}
+void hotplug_cleanup(void)   {}
 
 #endif /* HAVE_LIBUDEV */
@@ -8,6 +8,11 @@ typedef void (*hotplug_remove_cb)(const char *devpath);
  * Returns 0 on success, -1 on failure. */
 int hotplug_init(hotplug_add_cb on_add, hotplug_remove_cb on_remove);
 
+/* Call on_add for every keyboard/mouse event node udev knows about
+ * (ID_INPUT_KEYBOARD / ID_INPUT_MOUSE), without opening the others.
+ * Returns the number listed, or -1 without udev (probe /dev/input). */
+int hotplug_enumerate(void);
+
 /* Returns the udev monitor fd — add to epoll with EPOLLIN. */
 int hotplug_get_fd(void);
 
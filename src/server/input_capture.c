@@ -5,18 +5,163 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <linux/input.h>
 #include <libevdev/libevdev.h>
+#include "latency.h"
 
-#define MAX_DEVICES 16
+#define MAX_DEVICES    16
+#define FD_TABLE_SIZE  1024   /* fds above this are refused */
+#define READ_BATCH     64     /* input_events per read()    */
+#define KEY_LONGS      INPUT_BITS_LONGS(KEY_CNT)
 
 typedef struct {
     struct libevdev *dev;
+    int  fd;
     char path[256];
+    int  monotonic;   /* event timestamps use CLOCK_MONOTONIC (EVIOCSCLOCKID) */
+    int  hotkey;      /* can emit KEY_PAUSE: stays grabbed in LOCAL mode      */
+    int  grabbed;
+    int  grab_pending;/* (un)grab for the new mode waits for held keys to go up */
+    uint64_t grabbed_us;  /* last grab window, CLOCK_MONOTONIC: events      */
+    uint64_t ungrabbed_us;/* stamped inside it reached only us              */
+    int  dropping;    /* SYN_DROPPED seen: discard until the next SYN_REPORT */
+    int  resync;      /* key state must be diffed against EVIOCGKEY           */
+    unsigned long keys[KEY_LONGS];  /* keys/buttons passed on as held down */
 } Device;
 
 static Device devices[MAX_DEVICES];
 static int    num_devices = 0;
+static int    grab_all    = 0;   /* REMOTE: every device grabbed */
+static char   own_sysname[64];   /* our uinput device, never added */
+static void (*close_hook)(int fd) = NULL;
+
+/* fd -> index into devices[], -1 if untracked; rebuilt when devices move */
+static int8_t fd_index[FD_TABLE_SIZE];
+static int    fd_index_ready = 0;
+
+/* Raw events of one read(), converted into the caller's buffer */
+static struct input_event raw_events[READ_BATCH];
+
+static void rebuild_fd_index(void) {
+    memset(fd_index, -1, sizeof(fd_index));
+    for (int i = 0; i < num_devices; i++) {
+        fd_index[devices[i].fd] = (int8_t)i;
+    }
+    fd_index_ready = 1;
+}
+
+static int key_bit(const unsigned long *bits, int code) {
+    return (int)((bits[code / (8 * sizeof(long))] >> (code % (8 * sizeof(long)))) & 1);
+}
+
+static void set_key_bit(unsigned long *bits, int code, int on) {
+    unsigned long mask = 1ul << (code % (8 * sizeof(long)));
+    if (on) bits[code / (8 * sizeof(long))] |=  mask;
+    else    bits[code / (8 * sizeof(long))] &= ~mask;
+}
+
+static void fill_event(InputEvent *e, uint16_t type, uint16_t code, int32_t value,
+                       uint64_t read_us) {
+    e->type    = type;
+    e->code    = code;
+    e->value   = value;
+    e->local   = 0;
+    e->time_us = 0;
+    e->read_us = read_us;
+}
+
+static int grab(Device *d) {
+    if (libevdev_grab(d->dev, LIBEVDEV_GRAB) < 0) {
+        fprintf(stderr, "[INPUT] Failed to grab %s: %s\n", d->path, strerror(errno));
+        return -1;
+    }
+    d->grabbed      = 1;
+    d->grab_pending = 0;
+    d->grabbed_us   = latency_now_us();
+    return 0;
+}
+
+static void ungrab(Device *d) {
+    if (d->grabbed) {
+        libevdev_grab(d->dev, LIBEVDEV_UNGRAB);
+        d->ungrabbed_us = latency_now_us();
+    }
+    d->grabbed      = 0;
+    d->grab_pending = 0;
+}
+
+/* Bring the grab in line with the current mode */
+static int apply_grab(Device *d) {
+    if (d->hotkey || grab_all) return d->grabbed ? 0 : grab(d);
+    ungrab(d);
+    return 0;
+}
+
+/* Whether the desktop got an event stamped t, i.e. t lies outside the
+ * last grab window. Events queued across a grab change are classified by
+ * when they happened, not by when we read them; without a timestamp the
+ * current grab state decides. */
+static int seen_by_desktop(const Device *d, uint64_t t) {
+    if (t == 0) return !d->grabbed;
+    if (t < d->grabbed_us) return 1;
+    return !d->grabbed && t >= d->ungrabbed_us;
+}
+
+static int any_key_bit(const unsigned long *bits) {
+    for (size_t i = 0; i < KEY_LONGS; i++) {
+        if (bits[i]) return 1;
+    }
+    return 0;
+}
+
+/* Compare what we have passed on with the kernel's key state and append
+ * the press/release events (plus a closing SYN_REPORT) that bring the
+ * consumer back in line. Emits at most `room` events; if the diff does
+ * not fit, the rest is produced on the next call. Returns the count. */
+static int resync_keys(Device *d, InputEvent *out, int room, uint64_t read_us) {
+    unsigned long now[KEY_LONGS];
+    memset(now, 0, sizeof(now));
+    if (ioctl(d->fd, EVIOCGKEY(sizeof(now)), now) < 0) {
+        d->resync = 0;
+        return 0;
+    }
+
+    int n = 0, changed = 0;
+    for (int code = 0; code < KEY_CNT; code++) {
+        int down = key_bit(now, code);
+        if (key_bit(d->keys, code) == down) continue;
+        if (n >= room - 1) break;  /* keep space for SYN_REPORT */
+        fill_event(&out[n], EV_KEY, (uint16_t)code, down, read_us);
+        out[n++].local = !d->grabbed;
+        set_key_bit(d->keys, code, down);
+        changed++;
+    }
+    if (changed) {
+        fill_event(&out[n], EV_SYN, SYN_REPORT, 0, read_us);
+        out[n++].local = !d->grabbed;
+    }
+
+    d->resync = (memcmp(now, d->keys, sizeof(now)) != 0);
+    if (changed) {
+        printf("[INPUT] Resynced %d key(s) on %s after SYN_DROPPED\n", changed, d->path);
+    }
+    return n;
+}
+
+/* The inputN that owns an event node: /sys/class/input/eventM/device */
+static int parent_sysname(const char *path, char *out, size_t len) {
+    const char *node = strrchr(path, '/');
+    char link[128], target[256];
+    snprintf(link, sizeof(link), "/sys/class/input/%s/device", node ? node + 1 : path);
+    ssize_t n = readlink(link, target, sizeof(target) - 1);
+    if (n < 0) return -1;
+    target[n] = '\0';
+    const char *base = strrchr(target, '/');
+    snprintf(out, len, "%s", base ? base + 1 : target);
+    return 0;
+}
 
 static int path_exists(const char *path) {
     for (int i = 0; i < num_devices; i++) {
@@ -26,23 +171,36 @@ static int path_exists(const char *path) {
 }
 
 static void remove_at(int idx) {
-    int fd = libevdev_get_fd(devices[idx].dev);
-    libevdev_grab(devices[idx].dev, LIBEVDEV_UNGRAB);
+    int fd = devices[idx].fd;
+    ungrab(&devices[idx]);
     libevdev_free(devices[idx].dev);
+    if (close_hook) close_hook(fd);
     close(fd);
     for (int j = idx; j < num_devices - 1; j++) {
         devices[j] = devices[j + 1];
     }
     num_devices--;
     memset(&devices[num_devices], 0, sizeof(devices[0]));
+    rebuild_fd_index();
 }
 
 int input_capture_add_device(const char *path) {
     if (num_devices >= MAX_DEVICES) return -1;
     if (path_exists(path)) return -1;
 
+    /* Our own uinput passthrough device */
+    char sysname[64];
+    if (own_sysname[0] && parent_sysname(path, sysname, sizeof(sysname)) == 0 &&
+        strcmp(sysname, own_sysname) == 0) {
+        return -1;
+    }
+
     int fd = open(path, O_RDONLY | O_NONBLOCK);
     if (fd < 0) return -1;
+    if (fd >= FD_TABLE_SIZE) {
+        close(fd);
+        return -1;
+    }
 
     struct libevdev *dev = NULL;
     if (libevdev_new_from_fd(fd, &dev) < 0) {
@@ -58,25 +216,38 @@ int input_capture_add_device(const char *path) {
         return -1;
     }
 
-    /* Skip our own uinput passthrough device */
+    /* Skip virtual devices of other OneKM instances */
     if (strstr(libevdev_get_name(dev), "OneKM")) {
         libevdev_free(dev);
         close(fd);
         return -1;
     }
 
-    if (libevdev_grab(dev, LIBEVDEV_GRAB) < 0) {
-        fprintf(stderr, "[INPUT] Failed to grab %s: %s\n", path, strerror(errno));
+    Device *d = &devices[num_devices];
+    memset(d, 0, sizeof(*d));
+    d->dev = dev;
+    d->fd  = fd;
+    strncpy(d->path, path, sizeof(d->path) - 1);
+
+    /* Only devices that can produce the PAUSE hotkey need a grab in LOCAL
+     * mode; the rest (mice, keyboards without PAUSE) go straight to the
+     * desktop until the switch to REMOTE */
+    d->hotkey = libevdev_has_event_code(dev, EV_KEY, KEY_PAUSE);
+    if ((d->hotkey || grab_all) && grab(d) < 0) {
         libevdev_free(dev);
         close(fd);
         return -1;
     }
 
-    devices[num_devices].dev = dev;
-    strncpy(devices[num_devices].path, path, sizeof(devices[0].path) - 1);
+    /* Kernel timestamps default to CLOCK_REALTIME; monotonic ones can be
+     * compared with our own clock to see how long events sat in the buffer */
+    d->monotonic = libevdev_set_clock_id(dev, CLOCK_MONOTONIC) == 0;
+
     num_devices++;
+    rebuild_fd_index();
 
-    printf("[INPUT] Grabbed: %s (%s)\n", libevdev_get_name(dev), path);
+    printf("[INPUT] %s: %s (%s)\n", d->grabbed ? "Grabbed" : "Watching (REMOTE grab only)",
+           libevdev_get_name(dev), path);
     return fd;
 }
 
@@ -112,50 +283,186 @@ int input_capture_init(void) {
         return -1;
     }
 
-    printf("[INPUT] Grabbed %d device(s)\n", num_devices);
+    printf("[INPUT] Opened %d device(s)\n", num_devices);
     return 0;
 }
 
+void input_capture_set_grab_all(int on) {
+    grab_all = on;
+
+    int changed = 0, waiting = 0;
+    for (int i = 0; i < num_devices; i++) {
+        Device *d = &devices[i];
+        if (d->hotkey) continue;
+        if (d->grabbed == on) {
+            d->grab_pending = 0;
+            continue;
+        }
+
+        /* A key or button held across the change would be pressed on one
+         * side and released on the other (the desktop never hears about
+         * a grab), so the change waits for the release;
+         * input_capture_convert() applies it at that SYN_REPORT */
+        unsigned long now[KEY_LONGS];
+        memset(now, 0, sizeof(now));
+        ioctl(d->fd, EVIOCGKEY(sizeof(now)), now);
+        if (any_key_bit(now)) {
+            d->grab_pending = 1;
+            waiting++;
+        } else if (apply_grab(d) == 0) {
+            changed++;
+        }
+    }
+
+    if (changed || waiting) {
+        printf("[INPUT] %s %d device(s)", on ? "Grabbed" : "Released to the desktop:", changed);
+        if (waiting) printf(", %d more once their keys/buttons are up", waiting);
+        printf("\n");
+    }
+}
+
+void input_capture_snapshot_keys(unsigned long *held) {
+    memset(held, 0, KEY_LONGS * sizeof(held[0]));
+    for (int i = 0; i < num_devices; i++) {
+        Device *d = &devices[i];
+        if (!d->grabbed) continue;
+
+        unsigned long now[KEY_LONGS];
+        memset(now, 0, sizeof(now));
+        if (ioctl(d->fd, EVIOCGKEY(sizeof(now)), now) < 0) continue;
+
+        /* The caller presses these on the side being entered: a queued
+         * press of one of them is then a duplicate and is dropped */
+        memcpy(d->keys, now, sizeof(now));
+        d->resync = 0;
+        for (size_t j = 0; j < KEY_LONGS; j++) held[j] |= now[j];
+    }
+}
+
+int input_capture_count(void) {
+    return num_devices;
+}
+
+void input_capture_get_caps(InputCaps *caps) {
+    memset(caps, 0, sizeof(*caps));
+    for (int i = 0; i < num_devices; i++) {
+        InputCaps dev;
+        memset(&dev, 0, sizeof(dev));
+        ioctl(devices[i].fd, EVIOCGBIT(EV_KEY, sizeof(dev.key)), dev.key);
+        ioctl(devices[i].fd, EVIOCGBIT(EV_REL, sizeof(dev.rel)), dev.rel);
+        ioctl(devices[i].fd, EVIOCGBIT(EV_MSC, sizeof(dev.msc)), dev.msc);
+        for (size_t j = 0; j < INPUT_BITS_LONGS(KEY_CNT); j++) caps->key[j] |= dev.key[j];
+        for (size_t j = 0; j < INPUT_BITS_LONGS(REL_CNT); j++) caps->rel[j] |= dev.rel[j];
+        for (size_t j = 0; j < INPUT_BITS_LONGS(MSC_CNT); j++) caps->msc[j] |= dev.msc[j];
+    }
+}
+
+void input_capture_set_own_sysname(const char *sysname) {
+    snprintf(own_sysname, sizeof(own_sysname), "%s", sysname ? sysname : "");
+}
+
+void input_capture_set_close_hook(void (*hook)(int fd)) {
+    close_hook = hook;
+}
+
 int input_capture_get_fds(int *fds, int max_fds) {
     int count = (num_devices < max_fds) ? num_devices : max_fds;
     for (int i = 0; i < count; i++) {
-        fds[i] = libevdev_get_fd(devices[i].dev);
+        fds[i] = devices[i].fd;
     }
     return count;
 }
 
-int input_capture_read_fd(int fd, InputEvent *event) {
-    for (int i = 0; i < num_devices; i++) {
-        if (libevdev_get_fd(devices[i].dev) != fd) continue;
+void input_capture_device_gone(int fd) {
+    if (!fd_index_ready || fd < 0 || fd >= FD_TABLE_SIZE || fd_index[fd] < 0) return;
+    printf("[INPUT] Device disconnected: %s\n", devices[fd_index[fd]].path);
+    remove_at(fd_index[fd]);
+}
+
+int input_capture_convert(int fd, const struct input_event *raw, int count,
+                          InputEvent *events, int max_events) {
+    if (!fd_index_ready || fd < 0 || fd >= FD_TABLE_SIZE || fd_index[fd] < 0) return 0;
+    Device *d = &devices[fd_index[fd]];
+
+    int out = 0;
+    uint64_t read_us = latency_now_us();
 
-        struct input_event ev;
-        int rc;
+    /* Finish a resync whose diff did not fit last time */
+    if (d->resync) out += resync_keys(d, events, max_events - count, read_us);
 
-        rc = libevdev_next_event(devices[i].dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+    for (int i = 0; i < count; i++) {
+        const struct input_event *ev = &raw[i];
 
-        if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-            /* Drain dropped-event sync queue silently */
-            while (rc == LIBEVDEV_READ_STATUS_SYNC) {
-                rc = libevdev_next_event(devices[i].dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
+        /* Kernel buffer overflowed: the frame in progress is incomplete.
+         * Skip to the next SYN_REPORT, then diff the real key state so
+         * nothing stays held on either side. */
+        if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+            d->dropping = 1;
+            continue;
+        }
+        if (d->dropping) {
+            if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+                d->dropping = 0;
+                d->resync   = 1;
+                out += resync_keys(d, &events[out], max_events - out - (count - i - 1),
+                                   read_us);
             }
-            return -1;
+            continue;
         }
 
-        if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-            event->type  = ev.type;
-            event->code  = ev.code;
-            event->value = ev.value;
-            return 0;
+        if (ev->type == EV_KEY && ev->code < KEY_CNT) {
+            /* A press we already synthesized during resync */
+            if (ev->value == 1 && key_bit(d->keys, ev->code)) continue;
+            if (ev->value != 2) set_key_bit(d->keys, ev->code, ev->value != 0);
         }
 
-        /* rc < 0 */
-        if (rc == -ENODEV) {
-            printf("[INPUT] Device disconnected: %s\n", devices[i].path);
-            remove_at(i);
+        InputEvent *e = &events[out++];
+        fill_event(e, ev->type, ev->code, ev->value, read_us);
+        if (d->monotonic) {
+            e->time_us = (uint64_t)ev->input_event_sec * 1000000ull +
+                         (uint64_t)ev->input_event_usec;
         }
+
+        /* Outside the grab window the desktop has it already; inside it,
+         * only we saw it, even when read after the ungrab */
+        e->local = seen_by_desktop(d, e->time_us);
+        if (d->monotonic && !e->local) {
+            int cls = latency_class_of(ev->type, ev->code);
+            if (cls >= 0 && read_us >= e->time_us) {
+                latency_record(LAT_KERNEL_TO_READ, (LatencyClass)cls, read_us - e->time_us);
+            }
+        }
+
+        /* Deferred (un)grab: the last key is up at this frame */
+        if (d->grab_pending && ev->type == EV_SYN && ev->code == SYN_REPORT &&
+            !any_key_bit(d->keys) && apply_grab(d) == 0) {
+            printf("[INPUT] %s %s\n", d->grabbed ? "Grabbed" : "Released to the desktop:",
+                   d->path);
+        }
+    }
+    return out;
+}
+
+int input_capture_read_fd(int fd, InputEvent *events, int max_events) {
+    if (!fd_index_ready || fd < 0 || fd >= FD_TABLE_SIZE || fd_index[fd] < 0) return -1;
+    Device *d = &devices[fd_index[fd]];
+
+    /* The events go straight from the kernel, many per read(); libevdev is
+     * only used for probing and grabbing the device. The reserve leaves
+     * room for the events a resync may add. */
+    int want = max_events - INPUT_RESYNC_RESERVE;
+    if (want > READ_BATCH) want = READ_BATCH;
+    if (want <= 0) return -1;
+
+    ssize_t n = read(fd, raw_events, (size_t)want * sizeof(raw_events[0]));
+    if (n < 0 && errno == ENODEV) {
+        input_capture_device_gone(fd);
         return -1;
     }
-    return -1;
+    int count = n > 0 ? (int)((size_t)n / sizeof(raw_events[0])) : 0;
+    if (count == 0 && !d->resync) return -1;
+
+    return input_capture_convert(fd, raw_events, count, events, max_events);
 }
 
 void input_capture_cleanup(void) {
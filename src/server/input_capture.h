@@ -2,31 +2,90 @@
 #define INPUT_CAPTURE_H
 
 #include <stdint.h>
+#include <linux/input.h>
 
 typedef struct {
     uint16_t type;
     uint16_t code;
     int32_t  value;
+    uint8_t  local;     /* stamped while ungrabbed: the desktop saw it too    */
+    uint64_t time_us;   /* kernel timestamp (CLOCK_MONOTONIC), 0 if unavailable */
+    uint64_t read_us;   /* when input_capture_read_fd() returned it              */
 } InputEvent;
 
-/* Scan /dev/input/event* and grab all keyboard/mouse devices.
- * Returns 0 on success, -1 if no devices found. */
+#define INPUT_BITS_LONGS(n) (((n) + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long)))
+
+/* Capability bitmaps, as returned by EVIOCGBIT */
+typedef struct {
+    unsigned long key[INPUT_BITS_LONGS(KEY_CNT)];
+    unsigned long rel[INPUT_BITS_LONGS(REL_CNT)];
+    unsigned long msc[INPUT_BITS_LONGS(MSC_CNT)];
+} InputCaps;
+
+/* Probe every /dev/input/event* node and open the keyboards/mice, for
+ * systems without udev (see hotplug_enumerate()). Returns 0 on success,
+ * -1 if no devices found. */
 int input_capture_init(void);
 
-/* Add and grab a device by path. Returns the new fd, or -1 if not added
- * (already tracked, not a keyboard/mouse, or is our own uinput device). */
+int input_capture_count(void);
+
+/* Union of the tracked devices' EV_KEY/EV_REL/EV_MSC capabilities. */
+void input_capture_get_caps(InputCaps *caps);
+
+/* sysfs name (inputN, from UI_GET_SYSNAME) of our own uinput device;
+ * its event node is never added. */
+void input_capture_set_own_sysname(const char *sysname);
+
+/* Add a device by path. Devices that can emit KEY_PAUSE are always
+ * grabbed; the others only while grab-all is on (REMOTE mode). Returns
+ * the new fd, or -1 if not added (already tracked, not a keyboard/mouse,
+ * or is our own uinput device). */
 int input_capture_add_device(const char *path);
 
+/* Mode-aware grabs. On: grab every device, so nothing reaches the
+ * desktop. Off (LOCAL): release everything but the hotkey keyboards, so
+ * pointer input reaches the desktop without a detour through uinput. A
+ * device with a key or button held changes at the frame that releases
+ * it. Events from ungrabbed devices are still read, marked local. */
+void input_capture_set_grab_all(int on);
+
+/* Union of the keys and buttons held on the grabbed devices, from the
+ * kernel (EVIOCGKEY) — what a mode switch carries over to the side being
+ * entered. held[] has INPUT_BITS_LONGS(KEY_CNT) longs. */
+void input_capture_snapshot_keys(unsigned long *held);
+
 /* Ungrab and remove a device by path. No-op if not tracked. */
 void input_capture_remove_device(const char *path);
 
+/* Called with the fd of a tracked device just before it is closed, so a
+ * loop that has requests posted on it can cancel them while the number
+ * still means this device. */
+void input_capture_set_close_hook(void (*hook)(int fd));
+
 /* Copy currently tracked fds into fds[]. Returns count. */
 int input_capture_get_fds(int *fds, int max_fds);
 
-/* Read one event from the device that owns fd.
- * Returns 0 on success (event filled), -1 when no more events.
- * Handles ENODEV internally (removes disconnected device, closes fd). */
-int input_capture_read_fd(int fd, InputEvent *event);
+/* Room kept free in each batch for key resync events after SYN_DROPPED */
+#define INPUT_RESYNC_RESERVE 32
+
+/* Read pending events from the device that owns fd with a single read()
+ * (fd-indexed lookup) and record their kernel-to-read latency. At most
+ * max_events - INPUT_RESYNC_RESERVE are read; the reserve holds the
+ * synthesized press/release events that bring held keys and buttons back
+ * in line after a SYN_DROPPED. Returns the number of events filled (may
+ * be 0), or -1 when nothing was pending. Handles ENODEV internally
+ * (removes disconnected device, closes fd). */
+int input_capture_read_fd(int fd, InputEvent *events, int max_events);
+
+/* The conversion half of input_capture_read_fd(), for callers that read
+ * the fd themselves (io_uring backend): turns count raw events read from
+ * fd into events[] (room for count + INPUT_RESYNC_RESERVE) with the same
+ * SYN_DROPPED handling. Returns the number of events filled. */
+int input_capture_convert(int fd, const struct input_event *raw, int count,
+                          InputEvent *events, int max_events);
+
+/* A read on fd failed with ENODEV: remove the device and close fd. */
+void input_capture_device_gone(int fd);
 
 void input_capture_cleanup(void);
 
@@ -93,48 +93,25 @@ static const uint8_t linux_to_hid_keymap[256] = {
     [126] = 231     // KEY_RIGHTMETA -> Right GUI (Win key)
 };
 
-static HIDKeyboardReport current_report = {0};
+/* Key state as a bitmap of HID usages: any number of keys can be held.
+ * Links that only carry the 6KRO report fold it in uart_send(). */
+static HIDKeyboardBitmap current = {0};
 
 void keyboard_state_init(void) {
-    memset(&current_report, 0, sizeof(HIDKeyboardReport));
+    memset(&current, 0, sizeof(current));
 }
 
-static int find_key_in_report(uint8_t keycode) {
-    for (int i = 0; i < 6; i++) {
-        if (current_report.keys[i] == keycode) {
-            return i;
-        }
-    }
-    return -1;
+/* Usages 0xE0-0xE7 are the modifiers, in MODIFIER_* bit order */
+static int is_modifier(uint8_t hid_keycode) {
+    return hid_keycode >= 224 && hid_keycode <= 231;
 }
 
-static void remove_key_from_report(uint8_t keycode) {
-    int pos = find_key_in_report(keycode);
-    if (pos >= 0) {
-        for (int i = pos; i < 5; i++) {
-            current_report.keys[i] = current_report.keys[i + 1];
-        }
-        current_report.keys[5] = 0;
-    }
+static int key_bit_set(uint8_t hid_keycode) {
+    return (current.keys[hid_keycode / 8] >> (hid_keycode % 8)) & 1;
 }
 
-static int add_key_to_report(uint8_t keycode) {
-    if (find_key_in_report(keycode) >= 0) {
-        return 0;
-    }
-
-    for (int i = 0; i < 6; i++) {
-        if (current_report.keys[i] == 0) {
-            current_report.keys[i] = keycode;
-            return 1;
-        }
-    }
-
-    return -1;
-}
-
-int keyboard_state_process_key(uint16_t linux_keycode, uint8_t value, HIDKeyboardReport *report) {
-    if (!report || linux_keycode >= 256) {
+int keyboard_state_process_key(uint16_t linux_keycode, uint8_t value, HIDKeyboardBitmap *state) {
+    if (!state || linux_keycode >= 256) {
         return 0;
     }
 
@@ -147,82 +124,38 @@ int keyboard_state_process_key(uint16_t linux_keycode, uint8_t value, HIDKeyboar
         return 0;
     }
 
-    if (value) {
-        fprintf(stderr, "[DEBUG] Key: linux=%u hid=%u\n", linux_keycode, hid_keycode);
-    }
-
-    int state_changed = 0;
-
-    switch (hid_keycode) {
-        case 224:  // LCtrl
-            if (value) current_report.modifiers |= MODIFIER_LEFT_CTRL;
-            else current_report.modifiers &= ~MODIFIER_LEFT_CTRL;
-            state_changed = 1;
-            break;
-        case 228:  // RCtrl
-            if (value) current_report.modifiers |= MODIFIER_RIGHT_CTRL;
-            else current_report.modifiers &= ~MODIFIER_RIGHT_CTRL;
-            state_changed = 1;
-            break;
-        case 225:  // LShift
-            if (value) current_report.modifiers |= MODIFIER_LEFT_SHIFT;
-            else current_report.modifiers &= ~MODIFIER_LEFT_SHIFT;
-            state_changed = 1;
-            break;
-        case 229:  // RShift
-            if (value) current_report.modifiers |= MODIFIER_RIGHT_SHIFT;
-            else current_report.modifiers &= ~MODIFIER_RIGHT_SHIFT;
-            state_changed = 1;
-            break;
-        case 226:  // LAlt
-            if (value) current_report.modifiers |= MODIFIER_LEFT_ALT;
-            else current_report.modifiers &= ~MODIFIER_LEFT_ALT;
-            state_changed = 1;
-            break;
-        case 230:  // RAlt
-            if (value) current_report.modifiers |= MODIFIER_RIGHT_ALT;
-            else current_report.modifiers &= ~MODIFIER_RIGHT_ALT;
-            state_changed = 1;
-            break;
-        case 227:  // LGUI (Left Win key)
-            if (value) current_report.modifiers |= MODIFIER_LEFT_GUI;
-            else current_report.modifiers &= ~MODIFIER_LEFT_GUI;
-            state_changed = 1;
-            break;
-        case 231:  // RGUI (Right Win key)
-            if (value) current_report.modifiers |= MODIFIER_RIGHT_GUI;
-            else current_report.modifiers &= ~MODIFIER_RIGHT_GUI;
-            state_changed = 1;
-            break;
-        default:
-            if (value) {
-                if (add_key_to_report(hid_keycode) > 0) {
-                    state_changed = 1;
-                }
-            } else {
-                remove_key_from_report(hid_keycode);
-                state_changed = 1;
-            }
-            break;
+    uint8_t *byte;
+    uint8_t  mask;
+    if (is_modifier(hid_keycode)) {
+        byte = &current.modifiers;
+        mask = (uint8_t)(1u << (hid_keycode - 224));
+    } else if (hid_keycode < 8 * MSG_KEY_BITMAP_BYTES) {
+        byte = &current.keys[hid_keycode / 8];
+        mask = (uint8_t)(1u << (hid_keycode % 8));
+    } else {
+        return 0;
     }
 
-    if (state_changed) {
-        memcpy(report, &current_report, sizeof(HIDKeyboardReport));
-        return 1;
+    uint8_t old = *byte;
+    if (value) *byte |= mask;
+    else       *byte &= (uint8_t)~mask;
+    if (*byte == old) {
+        return 0;
     }
 
-    return 0;
+    memcpy(state, &current, sizeof(current));
+    return 1;
 }
 
-void keyboard_state_reset(HIDKeyboardReport *report) {
-    memset(&current_report, 0, sizeof(HIDKeyboardReport));
-    if (report) {
-        memcpy(report, &current_report, sizeof(HIDKeyboardReport));
+void keyboard_state_reset(HIDKeyboardBitmap *state) {
+    memset(&current, 0, sizeof(current));
+    if (state) {
+        memcpy(state, &current, sizeof(current));
     }
 }
 
-const HIDKeyboardReport* keyboard_state_get_current(void) {
-    return &current_report;
+const HIDKeyboardBitmap* keyboard_state_get_current(void) {
+    return &current;
 }
 
 int keyboard_state_is_key_pressed(uint16_t linux_keycode) {
@@ -235,26 +168,8 @@ int keyboard_state_is_key_pressed(uint16_t linux_keycode) {
         return 0;
     }
 
-    // Check modifiers
-    switch (hid_keycode) {
-        case 224:  // LCtrl
-            return (current_report.modifiers & MODIFIER_LEFT_CTRL) != 0;
-        case 228:  // RCtrl
-            return (current_report.modifiers & MODIFIER_RIGHT_CTRL) != 0;
-        case 225:  // LShift
-            return (current_report.modifiers & MODIFIER_LEFT_SHIFT) != 0;
-        case 229:  // RShift
-            return (current_report.modifiers & MODIFIER_RIGHT_SHIFT) != 0;
-        case 226:  // LAlt
-            return (current_report.modifiers & MODIFIER_LEFT_ALT) != 0;
-        case 230:  // RAlt
-            return (current_report.modifiers & MODIFIER_RIGHT_ALT) != 0;
-        case 227:  // LGUI (Left Win key)
-            return (current_report.modifiers & MODIFIER_LEFT_GUI) != 0;
-        case 231:  // RGUI (Right Win key)
-            return (current_report.modifiers & MODIFIER_RIGHT_GUI) != 0;
-        default:
-            // Check regular keys
-            return find_key_in_report(hid_keycode) >= 0;
+    if (is_modifier(hid_keycode)) {
+        return (current.modifiers >> (hid_keycode - 224)) & 1;
     }
+    return hid_keycode < 8 * MSG_KEY_BITMAP_BYTES && key_bit_set(hid_keycode);
 }
@@ -6,13 +6,15 @@
 
 void keyboard_state_init(void);
 
-int keyboard_state_process_key(uint16_t linux_keycode, uint8_t value, HIDKeyboardReport *report);
+// Apply a key press/release to the key bitmap. Returns 1 and copies the
+// new state into *state if it changed; there is no limit on held keys.
+int keyboard_state_process_key(uint16_t linux_keycode, uint8_t value, HIDKeyboardBitmap *state);
 
-void keyboard_state_reset(HIDKeyboardReport *report);
+void keyboard_state_reset(HIDKeyboardBitmap *state);
 
 // Get current software keyboard state
 // Returns pointer to internal state (do not modify)
-const HIDKeyboardReport* keyboard_state_get_current(void);
+const HIDKeyboardBitmap* keyboard_state_get_current(void);
 
 // Check if a specific Linux keycode is pressed in software state
 int keyboard_state_is_key_pressed(uint16_t linux_keycode);
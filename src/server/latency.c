@@ -0,0 +1,59 @@
+#include "latency.h"
+#include "histogram.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include <linux/input.h>
+
+/* One histogram set per recording thread (dispatch and, with --threaded,
+ * transport), so hist_add() keeps a single writer; merged on print. */
+#define LAT_THREADS 4
+
+static Histogram hist[LAT_THREADS][LAT_STAGES][LAT_CLASSES];
+static atomic_int next_slot = 0;
+static _Thread_local int slot = -1;
+
+static const char *const stage_names[LAT_STAGES] = {
+    "kernel->read", "read->dispatch", "dispatch->write",
+};
+static const char *const class_names[LAT_CLASSES] = {
+    "key", "button", "motion",
+};
+
+uint64_t latency_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000ull;
+}
+
+int latency_class_of(uint16_t type, uint16_t code) {
+    if (type == EV_REL) return LAT_MOTION;
+    if (type != EV_KEY) return -1;
+    return (code >= BTN_MISC && code < KEY_OK) ? LAT_BUTTON : LAT_KEY;
+}
+
+void latency_record(LatencyStage stage, LatencyClass cls, uint64_t us) {
+    if (slot < 0) {
+        slot = atomic_fetch_add(&next_slot, 1);
+        if (slot >= LAT_THREADS) {
+            fprintf(stderr, "[LATENCY] Too many recording threads\n");
+            slot = LAT_THREADS - 1;
+        }
+    }
+    hist_add(&hist[slot][stage][cls], us);
+}
+
+void latency_print(void) {
+    printf("[LATENCY] Capture pipeline (us):\n");
+    for (int s = 0; s < LAT_STAGES; s++) {
+        printf(" %s\n", stage_names[s]);
+        for (int c = 0; c < LAT_CLASSES; c++) {
+            Histogram merged;
+            hist_reset(&merged);
+            for (int t = 0; t < LAT_THREADS; t++) {
+                hist_merge(&merged, &hist[t][s][c]);
+            }
+            hist_print(class_names[c], &merged);
+        }
+    }
+}
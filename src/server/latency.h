@@ -0,0 +1,31 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+/* Per-stage input latency, split by event class, printed on SIGUSR1.
+ * All timestamps are CLOCK_MONOTONIC microseconds. */
+typedef enum {
+    LAT_KEY,
+    LAT_BUTTON,
+    LAT_MOTION,      /* relative axes, including the wheel */
+    LAT_CLASSES
+} LatencyClass;
+
+typedef enum {
+    LAT_KERNEL_TO_READ,      /* evdev timestamp -> read by input_capture      */
+    LAT_READ_TO_DISPATCH,    /* read -> dispatch_event()                       */
+    LAT_DISPATCH_TO_WRITE,   /* dispatch -> UART write() / uinput write done   */
+    LAT_STAGES
+} LatencyStage;
+
+uint64_t latency_now_us(void);
+
+/* Class of an evdev event, or -1 for events that are not tracked (SYN, MSC...) */
+int  latency_class_of(uint16_t type, uint16_t code);
+
+void latency_record(LatencyStage stage, LatencyClass cls, uint64_t us);
+
+void latency_print(void);
+
+#endif // LATENCY_H
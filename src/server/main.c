@@ -5,7 +5,7 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
-#include <time.h>
+#include <getopt.h>
 #include <sys/epoll.h>
 #include <linux/input.h>
 
@@ -17,43 +17,64 @@
 #include "uart.h"
 #include "state_machine.h"
 #include "keyboard_state.h"
+#include "latency.h"
+#include "timer.h"
+#include "sequence.h"
+#include "transport.h"
+#include "uring_loop.h"
 
 /* ------------------------------------------------------------------ */
 /* Constants                                                            */
 /* ------------------------------------------------------------------ */
 #define MAX_DEVICES       16
 #define MAX_EPOLL_EVENTS  32
-#define HEARTBEAT_INTERVAL_S  30   /* mouse-wiggle interval to keep Windows awake */
-#define INHIBIT_INTERVAL_S    25   /* XResetScreenSaver interval                  */
+#define EVENT_BATCH       (64 + INPUT_RESYNC_RESERVE)  /* one read() plus resync */
+#define HEARTBEAT_INTERVAL_MS 30000 /* mouse-wiggle interval to keep Windows awake */
+#define INHIBIT_INTERVAL_MS   25000 /* XResetScreenSaver interval                  */
 #define PAUSE_EXIT_COUNT       3   /* triple-press PAUSE to quit                  */
-#define PAUSE_EXIT_WINDOW_S    2   /* within this many seconds                    */
+#define PAUSE_EXIT_WINDOW_MS  2000 /* within this many milliseconds               */
 #define WIN_L_HOLD_MS         50   /* delay between Win+L press and release HID   */
+#define WIGGLE_STEP_MS        20   /* heartbeat: +1 move, then -1 this much later */
 
 /* ------------------------------------------------------------------ */
 /* Global state                                                         */
 /* ------------------------------------------------------------------ */
 static volatile int running = 1;
+static volatile sig_atomic_t stats_requested = 0;
 static int epoll_fd = -1;
+static int use_uring = 0;   /* io_uring backend instead of epoll (see uring_loop.h) */
+
+/* epoll loop syscall counts, for comparison with the io_uring stats */
+static unsigned long long loop_waits  = 0;
+static unsigned long long loop_reads  = 0;
+static unsigned long long loop_events = 0;
 
 /* PAUSE key press counting for exit */
-static int    pause_count      = 0;
-static time_t last_pause_time  = 0;
+static int      pause_count      = 0;
+static uint64_t last_pause_ms    = 0;
 
 /* Win+L tracking */
 static int meta_held     = 0;  /* is Left/Right Meta currently held in LOCAL mode? */
 static int remote_locked = 0;  /* Win+L was sent; suspend heartbeat until REMOTE */
 static int local_locked  = 0;  /* Win+L triggered local lock; suspend screensaver inhibit */
 
-/* Accumulated mouse movement (REMOTE mode) */
-static int pending_dx = 0;
-static int pending_dy = 0;
+/* Mouse state accumulated over one evdev frame (REMOTE mode), sent at SYN_REPORT */
+static int pending_dx      = 0;
+static int pending_dy      = 0;
+static int pending_wheel_v = 0;
+static int pending_wheel_h = 0;
 
-/* Mouse button state for clean release on mode switch */
+/* Mouse button state: current frame vs. last sent to the remote */
 static uint8_t mouse_buttons = 0;  /* bit0=left bit1=right bit2=middle */
+static uint8_t sent_buttons  = 0;
+
+/* Reusable buffer for one batch of captured events */
+static InputEvent input_frame[EVENT_BATCH];
 
-/* Heartbeat / inhibit timers */
-static time_t last_heartbeat = 0;
-static time_t last_inhibit   = 0;
+/* Heartbeat / inhibit timers (see timer.h) */
+static int heartbeat_timer = -1;
+static int inhibit_timer   = -1;
+static int uart_timer      = -1;   /* lanes waiting for the tty to drain */
 
 /* ------------------------------------------------------------------ */
 /* Helpers                                                              */
@@ -69,79 +90,124 @@ static void epoll_add(int fd) {
 
 /* Note: no explicit epoll_del needed — Linux removes closed fds from epoll automatically */
 
+/* Watch the UART fd for EPOLLOUT only while the transmit ring has data,
+ * and wake up when messages held back in the send lanes can go out.
+ * In threaded mode the transport thread does both instead. */
+static void uart_update_epoll(void) {
+    static int registered = 0;
+    static uint32_t current = 0;
+    int fd = uart_get_fd();
+    if (fd < 0 || transport_threaded()) return;
+
+    int retry_ms = uart_retry_ms();
+    if (retry_ms >= 0) {
+        timer_arm(uart_timer, (uint32_t)retry_ms, 0);
+    } else if (timer_pending(uart_timer)) {
+        timer_cancel(uart_timer);
+    }
+    if (use_uring) return;   /* writes go out through uring_loop_queue_writes() */
+
+    uint32_t want = EPOLLIN | (uart_tx_pending() ? EPOLLOUT : 0);
+    if (registered && want == current) return;
+
+    struct epoll_event ev;
+    ev.events  = want;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0) {
+        fprintf(stderr, "[MAIN] epoll_ctl UART fd=%d: %s\n", fd, strerror(errno));
+        return;
+    }
+    registered = 1;
+    current    = want;
+}
+
 /* ------------------------------------------------------------------ */
 /* Remote event sending                                                 */
 /* ------------------------------------------------------------------ */
+static int16_t clamp16(int v) {
+    return (int16_t)(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+}
+
+static int8_t clamp8(int v) {
+    return (int8_t)(v > 127 ? 127 : v < -128 ? -128 : v);
+}
+
+/* Send everything accumulated for the current evdev frame as one
+ * MSG_MOUSE_REPORT. Deltas too large for one report are split. */
 static void flush_mouse(void) {
-    if (pending_dx == 0 && pending_dy == 0) return;
     Message msg;
-    int16_t dx = (int16_t)(pending_dx > 32767 ? 32767 : pending_dx < -32768 ? -32768 : pending_dx);
-    int16_t dy = (int16_t)(pending_dy > 32767 ? 32767 : pending_dy < -32768 ? -32768 : pending_dy);
-    msg_mouse_move(&msg, dx, dy);
-    uart_send(&msg);
-    pending_dx -= dx;
-    pending_dy -= dy;
+
+    while (pending_dx != 0 || pending_dy != 0 ||
+           pending_wheel_v != 0 || pending_wheel_h != 0 ||
+           mouse_buttons != sent_buttons) {
+        int16_t dx    = clamp16(pending_dx);
+        int16_t dy    = clamp16(pending_dy);
+        int8_t  vert  = clamp8(pending_wheel_v);
+        int8_t  horiz = clamp8(pending_wheel_h);
+
+        msg_mouse_report(&msg, mouse_buttons, dx, dy, vert, horiz);
+        transport_send(&msg);
+
+        pending_dx      -= dx;
+        pending_dy      -= dy;
+        pending_wheel_v -= vert;
+        pending_wheel_h -= horiz;
+        sent_buttons     = mouse_buttons;
+    }
 }
 
 /* Release all held keys/buttons on the remote machine. */
 static void remote_release_all(void) {
     Message msg;
 
+    mouse_buttons = 0;
     flush_mouse();
 
-    HIDKeyboardReport zero = {0};
-    msg_keyboard_report(&msg, &zero);
-    uart_send(&msg);
-    keyboard_state_reset(NULL);
+    HIDKeyboardBitmap zero;
+    keyboard_state_reset(&zero);
+    msg_keyboard_bitmap(&msg, &zero);
+    transport_send(&msg);
+}
 
-    for (int i = 0; i < 3; i++) {
-        if (mouse_buttons & (uint8_t)(1u << i)) {
-            msg_mouse_button(&msg, (uint8_t)(i + 1), BUTTON_RELEASED);
-            uart_send(&msg);
-        }
+/* Report bit of a mouse button, 0 for anything else */
+static uint8_t button_bit(uint16_t code) {
+    switch (code) {
+        case BTN_LEFT:   return 0x01u;
+        case BTN_RIGHT:  return 0x02u;
+        case BTN_MIDDLE: return 0x04u;
+        default:         return 0;
     }
-    mouse_buttons = 0;
 }
 
 static void handle_remote_key(const InputEvent *ev) {
     Message msg;
 
-    /* Mouse buttons (BTN_LEFT=272, BTN_RIGHT=273, BTN_MIDDLE=274) */
-    if (ev->code == BTN_LEFT || ev->code == BTN_RIGHT || ev->code == BTN_MIDDLE) {
-        uint8_t btn = (ev->code == BTN_LEFT) ? 1u : (ev->code == BTN_RIGHT) ? 2u : 3u;
-        uint8_t bit = (uint8_t)(1u << (btn - 1));
+    /* Mouse buttons: sent at SYN_REPORT */
+    uint8_t bit = button_bit(ev->code);
+    if (bit) {
         if (ev->value) mouse_buttons |=  bit;
-        else           mouse_buttons &= ~bit;
-        msg_mouse_button(&msg, btn, (uint8_t)ev->value);
-        uart_send(&msg);
+        else           mouse_buttons &= (uint8_t)~bit;
         return;
     }
 
     /* Key repeat (value==2): target machine handles its own repeat */
     if (ev->value == 2) return;
 
-    HIDKeyboardReport report;
-    if (keyboard_state_process_key(ev->code, (uint8_t)ev->value, &report)) {
-        msg_keyboard_report(&msg, &report);
-        uart_send(&msg);
+    HIDKeyboardBitmap state;
+    if (keyboard_state_process_key(ev->code, (uint8_t)ev->value, &state)) {
+        msg_keyboard_bitmap(&msg, &state);
+        transport_send(&msg);
     }
 }
 
+/* Relative axes only accumulate; the frame is sent at SYN_REPORT */
 static void handle_remote_rel(const InputEvent *ev) {
-    Message msg;
-
-    if (ev->code == REL_X) {
-        pending_dx += ev->value;
-    } else if (ev->code == REL_Y) {
-        pending_dy += ev->value;
-        /* Flush when we have both axes — reduces packets */
-        if (pending_dx != 0 || pending_dy != 0) flush_mouse();
-    } else if (ev->code == REL_WHEEL || ev->code == REL_HWHEEL) {
-        flush_mouse();
-        int16_t vert  = (ev->code == REL_WHEEL)  ? (int16_t)ev->value : 0;
-        int16_t horiz = (ev->code == REL_HWHEEL) ? (int16_t)ev->value : 0;
-        msg_mouse_wheel(&msg, vert, horiz);
-        uart_send(&msg);
+    switch (ev->code) {
+        case REL_X:      pending_dx      += ev->value; break;
+        case REL_Y:      pending_dy      += ev->value; break;
+        case REL_WHEEL:  pending_wheel_v += ev->value; break;
+        case REL_HWHEEL: pending_wheel_h += ev->value; break;
+        default: break;
     }
 }
 
@@ -149,22 +215,19 @@ static void handle_remote_rel(const InputEvent *ev) {
 /* Win+L: lock both machines                                            */
 /* ------------------------------------------------------------------ */
 static void trigger_remote_lock(void) {
-    Message msg;
+    Sequence seq;
     HIDKeyboardReport rpt = {0};
 
-    /* Press Win+L */
+    /* Press Win+L, hold briefly so the target OS registers the combo,
+     * release — played out by the timers, input keeps flowing meanwhile */
     rpt.modifiers = MODIFIER_LEFT_GUI;
     rpt.keys[0]   = 15;  /* HID usage code for 'L' */
-    msg_keyboard_report(&msg, &rpt);
-    uart_send(&msg);
-
-    /* Hold briefly so the target OS registers the combo */
-    usleep(WIN_L_HOLD_MS * 1000);
-
-    /* Release */
-    memset(&rpt, 0, sizeof(rpt));
-    msg_keyboard_report(&msg, &rpt);
-    uart_send(&msg);
+    sequence_begin(&seq);
+    sequence_tap(&seq, &rpt, WIN_L_HOLD_MS);
+    if (sequence_start(&seq) != 0) {
+        fprintf(stderr, "[LOCK] Sequence queue full, Win+L not sent\n");
+        return;
+    }
 
     remote_locked = 1;
     printf("[LOCK] Win+L sent to remote; heartbeat suspended until next REMOTE session\n");
@@ -173,15 +236,74 @@ static void trigger_remote_lock(void) {
 /* ------------------------------------------------------------------ */
 /* Mode switching                                                       */
 /* ------------------------------------------------------------------ */
+/* Keys and buttons physically held at a switch (Ctrl of Ctrl+PAUSE, a
+ * mouse button mid-drag) are released on the side being left and pressed
+ * on the side being entered, each side in one burst. PAUSE itself is
+ * never forwarded. */
+static int held_bit(const unsigned long *held, int code) {
+    return code != KEY_PAUSE &&
+           (int)((held[code / (8 * sizeof(long))] >> (code % (8 * sizeof(long)))) & 1);
+}
+
+static void remote_press_held(const unsigned long *held) {
+    HIDKeyboardBitmap state;
+    int changed = 0;
+
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (!held_bit(held, code)) continue;
+        uint8_t bit = button_bit((uint16_t)code);
+        if (bit) {
+            mouse_buttons |= bit;
+        } else if (keyboard_state_process_key((uint16_t)code, 1, &state)) {
+            changed = 1;
+        }
+    }
+
+    if (changed) {
+        Message msg;
+        msg_keyboard_bitmap(&msg, &state);
+        transport_send(&msg);
+    }
+    flush_mouse();
+}
+
+static void local_press_held(const unsigned long *held) {
+    int pressed = 0;
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (!held_bit(held, code)) continue;
+        uinput_inject_event(EV_KEY, (uint16_t)code, 1);
+        pressed++;
+    }
+    if (pressed) uinput_inject_event(EV_SYN, SYN_REPORT, 0);
+}
+
 static void switch_to_remote(void) {
+    /* From here on every device reports only to us */
+    input_capture_set_grab_all(1);
+
+    unsigned long held[INPUT_BITS_LONGS(KEY_CNT)];
+    input_capture_snapshot_keys(held);
+
+    /* Leaving LOCAL: nothing stays held on the desktop */
+    uinput_inject_release_all();
+
     keyboard_state_reset(NULL);
-    pending_dx  = 0;
-    pending_dy  = 0;
-    mouse_buttons = 0;
+    pending_dx      = 0;
+    pending_dy      = 0;
+    pending_wheel_v = 0;
+    pending_wheel_h = 0;
+    mouse_buttons   = 0;
+    sent_buttons    = 0;
 
     Message msg;
     msg_switch(&msg, CONTROL_REMOTE);
-    uart_send(&msg);
+    transport_send(&msg);
+
+    /* Entering REMOTE: what is held now, so its release pairs up there */
+    remote_press_held(held);
+
+    /* The remote is in use now; no need to keep it awake */
+    timer_cancel(heartbeat_timer);
 
     state_set(STATE_REMOTE);
 }
@@ -191,12 +313,23 @@ static void switch_to_local(void) {
 
     Message msg;
     msg_switch(&msg, CONTROL_LOCAL);
-    uart_send(&msg);
+    transport_send(&msg);
+
+    /* Pointer devices go straight to the desktop again, once their
+     * buttons are up; until then they pass through uinput */
+    input_capture_set_grab_all(0);
+
+    unsigned long held[INPUT_BITS_LONGS(KEY_CNT)];
+    input_capture_snapshot_keys(held);
+    local_press_held(held);
 
     /* User is actively switching back — clear any lock suspension */
     remote_locked = 0;
     local_locked  = 0;
-    meta_held     = 0;
+    meta_held     = held_bit(held, KEY_LEFTMETA) || held_bit(held, KEY_RIGHTMETA);
+
+    /* The remote was just in use: first wiggle one full interval from now */
+    timer_arm(heartbeat_timer, HEARTBEAT_INTERVAL_MS, HEARTBEAT_INTERVAL_MS);
 
     state_set(STATE_LOCAL);
 }
@@ -205,14 +338,14 @@ static void switch_to_local(void) {
 /* PAUSE key handler                                                    */
 /* ------------------------------------------------------------------ */
 static void handle_pause_press(void) {
-    time_t now = time(NULL);
+    uint64_t now = timer_now_ms();
 
-    if (now - last_pause_time <= PAUSE_EXIT_WINDOW_S) {
+    if (last_pause_ms && now - last_pause_ms <= PAUSE_EXIT_WINDOW_MS) {
         pause_count++;
     } else {
         pause_count = 1;
     }
-    last_pause_time = now;
+    last_pause_ms = now;
 
     if (pause_count >= PAUSE_EXIT_COUNT) {
         printf("[MAIN] PAUSE x%d — exiting\n", PAUSE_EXIT_COUNT);
@@ -233,7 +366,41 @@ static void handle_pause_press(void) {
 /* ------------------------------------------------------------------ */
 /* Central event dispatcher                                             */
 /* ------------------------------------------------------------------ */
+/* Meta tracking for Win+L detection in LOCAL mode */
+static void track_local_key(const InputEvent *ev) {
+    if (ev->code == KEY_LEFTMETA || ev->code == KEY_RIGHTMETA) {
+        meta_held = (ev->value != 0);
+    }
+    /* Win+L: inject locally (triggers Linux lock) AND lock remote */
+    if (ev->code == KEY_L && ev->value == 1 && meta_held) {
+        trigger_remote_lock();
+        local_locked = 1;
+    }
+
+    /* Once locked, the first non-Meta/L keydown means the user is
+     * unlocking (typing password) — resume normal screensaver inhibit. */
+    if (local_locked && ev->value == 1 &&
+        ev->code != KEY_LEFTMETA && ev->code != KEY_RIGHTMETA &&
+        ev->code != KEY_L) {
+        local_locked = 0;
+        printf("[LOCK] Local input resumed; screensaver inhibit re-enabled\n");
+    }
+}
+
 static void dispatch_event(const InputEvent *ev) {
+    /* From an ungrabbed device: the desktop already has it, so it is
+     * only watched for Win+L, never injected or sent */
+    if (ev->local) {
+        if (state_get() == STATE_LOCAL && ev->type == EV_KEY) track_local_key(ev);
+        return;
+    }
+
+    uint64_t dispatch_us = latency_now_us();
+    int cls = latency_class_of(ev->type, ev->code);
+    if (cls >= 0) {
+        latency_record(LAT_READ_TO_DISPATCH, (LatencyClass)cls, dispatch_us - ev->read_us);
+    }
+
     /* PAUSE is always consumed here, never forwarded */
     if (ev->type == EV_KEY && ev->code == KEY_PAUSE) {
         if (ev->value == 1) handle_pause_press();
@@ -241,37 +408,32 @@ static void dispatch_event(const InputEvent *ev) {
     }
 
     if (state_get() == STATE_LOCAL) {
-        /* Track Meta key for Win+L detection */
-        if (ev->type == EV_KEY) {
-            if (ev->code == KEY_LEFTMETA || ev->code == KEY_RIGHTMETA) {
-                meta_held = (ev->value != 0);
-            }
-            /* Win+L: inject locally (triggers Linux lock) AND lock remote */
-            if (ev->code == KEY_L && ev->value == 1 && meta_held) {
-                trigger_remote_lock();
-                local_locked = 1;
-                /* Fall through: still inject to uinput so Linux locks too */
-            }
-
-            /* Once locked, the first non-Meta/L keydown means the user is
-             * unlocking (typing password) — resume normal screensaver inhibit. */
-            if (local_locked && ev->value == 1 &&
-                ev->code != KEY_LEFTMETA && ev->code != KEY_RIGHTMETA &&
-                ev->code != KEY_L) {
-                local_locked = 0;
-                printf("[LOCK] Local input resumed; screensaver inhibit re-enabled\n");
-            }
-        }
+        /* Win+L still goes to uinput below so Linux locks too */
+        if (ev->type == EV_KEY) track_local_key(ev);
 
         /* Pass the raw event to the local virtual device */
         uinput_inject_event(ev->type, ev->code, ev->value);
+        if (cls >= 0) {
+            latency_record(LAT_DISPATCH_TO_WRITE, (LatencyClass)cls,
+                           latency_now_us() - dispatch_us);
+        }
 
     } else { /* STATE_REMOTE */
-        /* Ignore SYN/MSC — only process actionable input */
-        if (ev->type == EV_SYN || ev->type == EV_MSC) return;
+        /* SYN_REPORT closes an evdev frame: send the accumulated mouse state */
+        if (ev->type == EV_SYN) {
+            if (ev->code == SYN_REPORT) {
+                transport_set_origin(mouse_buttons != sent_buttons ? LAT_BUTTON : LAT_MOTION,
+                                dispatch_us);
+                flush_mouse();
+                transport_set_origin(-1, 0);
+            }
+            return;
+        }
 
         if (ev->type == EV_KEY) {
+            transport_set_origin(cls, dispatch_us);
             handle_remote_key(ev);
+            transport_set_origin(-1, 0);
         } else if (ev->type == EV_REL) {
             handle_remote_rel(ev);
         }
@@ -283,9 +445,30 @@ static void dispatch_event(const InputEvent *ev) {
 /* ------------------------------------------------------------------ */
 static void on_device_added(const char *path) {
     int fd = input_capture_add_device(path);
-    if (fd >= 0) {
+    if (fd < 0) return;
+
+    /* Startup enumeration runs before the loop exists */
+    if (use_uring) {
+        uring_loop_watch_input(fd);
+    } else if (epoll_fd >= 0) {
         epoll_add(fd);
     }
+
+    /* A device with keys the virtual device lacks: recreate it, now or
+     * once nothing is held (see apply_uinput_rebuild()) */
+    InputCaps caps;
+    input_capture_get_caps(&caps);
+    if (uinput_inject_update_caps(&caps) > 0) {
+        input_capture_set_own_sysname(uinput_inject_get_sysname());
+    }
+}
+
+/* A rebuild put off while keys were held; the new device's hotplug event
+ * comes later, so the sysname is known before it is seen */
+static void apply_uinput_rebuild(void) {
+    if (uinput_inject_rebuild_if_idle() > 0) {
+        input_capture_set_own_sysname(uinput_inject_get_sysname());
+    }
 }
 
 static void on_device_removed(const char *path) {
@@ -304,40 +487,98 @@ static void signal_handler(int sig) {
     running = 0;
 }
 
+static void stats_signal_handler(int sig) {
+    (void)sig;
+    stats_requested = 1;
+}
+
+static void print_stats(void) {
+    transport_print_stats();
+    if (use_uring) {
+        uring_loop_print_stats();
+    } else {
+        printf("[MAIN] epoll: %llu epoll_wait() + %llu read() calls for %llu events",
+               loop_waits, loop_reads, loop_events);
+        if (loop_events > 0) {
+            printf(" — per 1000 events: %.0f syscalls",
+                   (double)(loop_waits + loop_reads) * 1000.0 / (double)loop_events);
+        }
+        printf("\n");
+    }
+    uinput_inject_print_stats();
+    latency_print();
+}
+
 /* ------------------------------------------------------------------ */
 /* Periodic tasks                                                       */
 /* ------------------------------------------------------------------ */
-static void handle_periodic(void) {
-    time_t now = time(NULL);
-
-    /* Prevent X11 screensaver — but not when we've locked the screen via Win+L,
-     * otherwise XResetScreenSaver keeps the display awake on the lock screen. */
-    if (!local_locked && now - last_inhibit >= INHIBIT_INTERVAL_S) {
-        inhibit_reset();
-        last_inhibit = now;
-    }
-
-    /* Heartbeat: small mouse wiggle to keep Windows from sleeping.
-     * Only when LOCAL (we're not actively using the remote) and not locked. */
-    if (state_get() == STATE_LOCAL && !remote_locked) {
-        if (last_heartbeat == 0) {
-            last_heartbeat = now;
-        } else if (now - last_heartbeat >= HEARTBEAT_INTERVAL_S) {
-            Message msg;
-            /* Two-step wiggle: +1 then -1 pixel so cursor returns to origin */
-            msg_mouse_move(&msg, 1, 1);
-            uart_send(&msg);
-            msg_mouse_move(&msg, -1, -1);
-            uart_send(&msg);
-            last_heartbeat = now;
-            printf("[HEARTBEAT] Sent mouse wiggle to keep remote awake\n");
-        }
+/* Prevent X11 screensaver — but not when we've locked the screen via Win+L,
+ * otherwise XResetScreenSaver keeps the display awake on the lock screen. */
+static void on_inhibit_timer(void *ctx) {
+    (void)ctx;
+    if (!local_locked) inhibit_reset();
+}
+
+/* Heartbeat: small mouse wiggle to keep Windows from sleeping.
+ * Only when LOCAL (we're not actively using the remote) and not locked. */
+static void on_heartbeat_timer(void *ctx) {
+    (void)ctx;
+    if (state_get() != STATE_LOCAL || remote_locked) return;
+
+    /* Two-step wiggle: +1 then -1 pixel so cursor returns to origin. The
+     * steps are spaced out, otherwise the send lanes merge them into
+     * nothing. */
+    Sequence seq;
+    Message msg;
+    sequence_begin(&seq);
+    msg_mouse_move(&msg, 1, 1);
+    sequence_add(&seq, &msg, 0);
+    msg_mouse_move(&msg, -1, -1);
+    sequence_add(&seq, &msg, WIGGLE_STEP_MS);
+    if (sequence_start(&seq) == 0) {
+        printf("[HEARTBEAT] Sent mouse wiggle to keep remote awake\n");
     }
+}
 
-    /* Flush any residual mouse movement in REMOTE mode */
-    if (state_get() == STATE_REMOTE) {
-        flush_mouse();
+/* Lanes can take more: uart_flush() at the end of this loop iteration
+ * does the work */
+static void on_uart_timer(void *ctx) {
+    (void)ctx;
+}
+
+/* ------------------------------------------------------------------ */
+/* Event loop                                                           */
+/* ------------------------------------------------------------------ */
+static void dispatch_batch(const InputEvent *events, int count) {
+    for (int j = 0; j < count; j++) {
+        dispatch_event(&events[j]);
+    }
+}
+
+/* The loop's own fds, shared by both backends (EPOLLIN/ERR/HUP have the
+ * same values as POLLIN/ERR/HUP). Returns 0 if fd is none of them. */
+static int handle_ready_fd(int fd, uint32_t revents) {
+    int uart_fd = transport_threaded() ? -1 : uart_get_fd();
+
+    if (fd == hotplug_get_fd()) {
+        hotplug_process();
+    } else if (fd == timer_get_fd()) {
+        timer_process();
+    } else if (fd == uart_fd) {
+        if (revents & (EPOLLERR | EPOLLHUP)) {
+            fprintf(stderr, "[MAIN] UART error/hangup — exiting\n");
+            running = 0;
+        }
+        if (revents & EPOLLIN) uart_receive();
+        /* EPOLLOUT: drained by uart_flush() at the end of the iteration */
+    } else {
+        return 0;
     }
+    return 1;
+}
+
+static void on_uring_ready(int fd, uint32_t revents) {
+    handle_ready_fd(fd, revents);
 }
 
 /* ------------------------------------------------------------------ */
@@ -346,43 +587,102 @@ static void handle_periodic(void) {
 int main(int argc, char *argv[]) {
     const char *uart_port = "/dev/ttyACM0";
     int baud_rate = 230400;
+    int flow_control = 0;
+    int max_baud = 0;
+    int threaded = 0;
+    int want_uring = 0;
+    int capture_cpu   = -1;
+    int transport_cpu = -1;
+
+    static const struct option long_options[] = {
+        { "rtscts",        no_argument,       NULL, 'r' },
+        { "max-baud",      required_argument, NULL, 'b' },
+        { "threaded",      no_argument,       NULL, 't' },
+        { "capture-cpu",   required_argument, NULL, 'c' },
+        { "transport-cpu", required_argument, NULL, 'p' },
+        { "io-uring",      no_argument,       NULL, 'u' },
+        { "help",          no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "rb:tc:p:uh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r': flow_control = 1; break;
+            case 't': threaded = 1; break;
+            case 'u': want_uring = 1; break;
+            case 'c': capture_cpu   = atoi(optarg); break;
+            case 'p': transport_cpu = atoi(optarg); break;
+            case 'b':
+                max_baud = atoi(optarg);
+                if (max_baud < UART_BAUD_MIN || max_baud > UART_BAUD_MAX) {
+                    fprintf(stderr, "[MAIN] Unsupported --max-baud %s, ignoring\n", optarg);
+                    max_baud = 0;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--rtscts] [--max-baud RATE] [--threaded] "
+                        "[--capture-cpu N] [--transport-cpu N] [--io-uring] [port] [baud]\n", argv[0]);
+                fprintf(stderr, "  --rtscts         enable RTS/CTS hardware flow control\n");
+                fprintf(stderr, "  --max-baud       switch up to RATE after the handshake if the firmware allows\n");
+                fprintf(stderr, "  --threaded       write the UART from a dedicated transport thread\n");
+                fprintf(stderr, "  --capture-cpu    pin the capture/dispatch thread to core N\n");
+                fprintf(stderr, "  --transport-cpu  pin the transport thread to core N (with --threaded)\n");
+                fprintf(stderr, "  --io-uring       run the event loop on io_uring instead of epoll\n");
+                fprintf(stderr, "  baud             firmware boot rate, %d..%d (default 230400)\n",
+                        UART_BAUD_MIN, UART_BAUD_MAX);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
 
-    if (argc > 1) uart_port = argv[1];
-    if (argc > 2) {
-        baud_rate = atoi(argv[2]);
-        if (baud_rate != 115200 && baud_rate != 230400 &&
-            baud_rate != 460800 && baud_rate != 921600) {
-            fprintf(stderr, "[MAIN] Unsupported baud rate %d, defaulting to 230400\n", baud_rate);
-            baud_rate = 230400;
+    if (optind < argc) uart_port = argv[optind++];
+    if (optind < argc) {
+        char *end;
+        long rate = strtol(argv[optind], &end, 10);
+        if (*end != '\0' || rate < UART_BAUD_MIN || rate > UART_BAUD_MAX) {
+            fprintf(stderr, "[MAIN] Unsupported baud rate %s, defaulting to 230400\n", argv[optind]);
+        } else {
+            baud_rate = (int)rate;
         }
     }
 
     printf("OneKM Server 2.0\n");
-    printf("UART: %s @ %d baud\n", uart_port, baud_rate);
+    printf("UART: %s @ %d baud%s\n", uart_port, baud_rate, flow_control ? " (RTS/CTS)" : "");
 
     signal(SIGINT,  signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, stats_signal_handler);
 
-    /* Initialise uinput FIRST so the virtual device exists before we scan
-     * /dev/input — otherwise we might accidentally grab our own device. */
-    if (uinput_inject_init() != 0) {
-        fprintf(stderr, "[MAIN] Failed to create uinput virtual device\n");
-        return 1;
+    /* Monitor first, so a device plugged in during the scan is not missed */
+    if (hotplug_init(on_device_added, on_device_removed) != 0) {
+        fprintf(stderr, "[MAIN] Warning: hotplug unavailable\n");
     }
 
-    if (input_capture_init() != 0) {
+    /* Keyboards and mice as udev classifies them; without udev, probe
+     * every /dev/input/event* node */
+    if (hotplug_enumerate() < 0) input_capture_init();
+    if (input_capture_count() == 0) {
         fprintf(stderr, "[MAIN] Failed to grab input devices\n");
-        uinput_inject_cleanup();
+        hotplug_cleanup();
         return 1;
     }
 
-    if (hotplug_init(on_device_added, on_device_removed) != 0) {
-        fprintf(stderr, "[MAIN] Warning: hotplug unavailable\n");
+    /* The virtual device mirrors what was found. It is created after the
+     * scan and recognised by its sysname when its own add event arrives. */
+    {
+        InputCaps caps;
+        input_capture_get_caps(&caps);
+        if (uinput_inject_init(&caps) != 0) {
+            fprintf(stderr, "[MAIN] Failed to create uinput virtual device\n");
+            hotplug_cleanup();
+            input_capture_cleanup();
+            return 1;
+        }
+        input_capture_set_own_sysname(uinput_inject_get_sysname());
     }
 
     inhibit_init();   /* non-fatal if X11 not available */
 
-    if (uart_init(uart_port, baud_rate) != 0) {
+    if (uart_init(uart_port, baud_rate, flow_control, max_baud) != 0) {
         fprintf(stderr, "[MAIN] Failed to initialise UART\n");
         hotplug_cleanup();
         input_capture_cleanup();
@@ -390,36 +690,106 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (capture_cpu >= 0 && transport_pin_self(capture_cpu) == 0) {
+        printf("[MAIN] Capture/dispatch pinned to CPU %d\n", capture_cpu);
+    }
+    if (want_uring && threaded) {
+        /* The io_uring loop submits the UART writes itself */
+        fprintf(stderr, "[MAIN] --io-uring writes the UART inline, ignoring --threaded\n");
+        threaded = 0;
+    }
+    if (transport_init(threaded, transport_cpu) != 0) {
+        fprintf(stderr, "[MAIN] Transport thread unavailable, writing inline\n");
+    }
+
     state_init();
     keyboard_state_init();
 
-    /* Build epoll set */
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd < 0) {
-        perror("[MAIN] epoll_create1");
+    if (timer_init() != 0) {
+        fprintf(stderr, "[MAIN] Failed to create timerfd\n");
+        goto shutdown;
+    }
+    inhibit_timer   = timer_create_slot(on_inhibit_timer, NULL);
+    heartbeat_timer = timer_create_slot(on_heartbeat_timer, NULL);
+    uart_timer      = timer_create_slot(on_uart_timer, NULL);
+    timer_arm(inhibit_timer, 0, INHIBIT_INTERVAL_MS);
+    timer_arm(heartbeat_timer, HEARTBEAT_INTERVAL_MS, HEARTBEAT_INTERVAL_MS);
+    if (sequence_init() != 0) {
+        fprintf(stderr, "[MAIN] Failed to create sequence timer\n");
         goto shutdown;
     }
 
-    /* Register all input device fds */
-    {
+    if (want_uring) {
+        if (uring_loop_init() == 0) {
+            use_uring = 1;
+        } else {
+            fprintf(stderr, "[MAIN] io_uring unavailable, using epoll\n");
+        }
+    }
+
+    if (use_uring) {
+        /* Multishot reads on the input fds, multishot polls on the rest */
+        input_capture_set_close_hook(uring_loop_unwatch_input);
         int fds[MAX_DEVICES];
         int n = input_capture_get_fds(fds, MAX_DEVICES);
-        for (int i = 0; i < n; i++) epoll_add(fds[i]);
-    }
+        for (int i = 0; i < n; i++) uring_loop_watch_input(fds[i]);
+        uring_loop_watch(hotplug_get_fd());
+        uring_loop_watch(timer_get_fd());
+        uring_loop_watch(uart_get_fd());
+    } else {
+        /* Build epoll set */
+        epoll_fd = epoll_create1(0);
+        if (epoll_fd < 0) {
+            perror("[MAIN] epoll_create1");
+            goto shutdown;
+        }
 
-    /* Register udev monitor fd */
-    {
-        int ufd = hotplug_get_fd();
-        if (ufd >= 0) epoll_add(ufd);
+        /* Register all input device fds */
+        {
+            int fds[MAX_DEVICES];
+            int n = input_capture_get_fds(fds, MAX_DEVICES);
+            for (int i = 0; i < n; i++) epoll_add(fds[i]);
+        }
+
+        /* Register udev monitor fd */
+        {
+            int ufd = hotplug_get_fd();
+            if (ufd >= 0) epoll_add(ufd);
+        }
+
+        /* Register timerfd: armed only for the next due deadline */
+        epoll_add(timer_get_fd());
     }
 
-    printf("[MAIN] Ready. PAUSE = toggle LOCAL/REMOTE, PAUSE x3 = exit\n");
+    /* Register UART fd (EPOLLOUT is armed only while data is queued) */
+    uart_update_epoll();
+
+    printf("[MAIN] Ready. PAUSE = toggle LOCAL/REMOTE, PAUSE x3 = exit, SIGUSR1 = stats\n");
 
     /* ---- Main event loop ---- */
     struct epoll_event events[MAX_EPOLL_EVENTS];
+    const UringHandlers uring_handlers = { dispatch_batch, on_uring_ready };
 
     while (running && !state_should_exit()) {
-        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, 200 /* ms */);
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats();
+        }
+
+        if (use_uring) {
+            /* Completions are dispatched as they arrive; the uinput and
+             * UART writes they produce go out with the next wait */
+            if (uring_loop_run_once(&uring_handlers) != 0) break;
+            uring_loop_queue_writes();
+            apply_uinput_rebuild();
+            uart_update_epoll();
+            continue;
+        }
+
+        /* No periodic poll: timers wake us through the timerfd, signals
+         * through EINTR */
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        loop_waits++;
 
         if (n < 0) {
             if (errno == EINTR) continue;
@@ -427,39 +797,56 @@ int main(int argc, char *argv[]) {
             break;
         }
 
-        int udev_fd = hotplug_get_fd();
-
         for (int i = 0; i < n; i++) {
             int fd = events[i].data.fd;
-
-            if (fd == udev_fd) {
-                hotplug_process();
-                continue;
-            }
-
-            /* Drain all buffered events from this device fd */
-            InputEvent ev;
-            while (input_capture_read_fd(fd, &ev) == 0) {
-                dispatch_event(&ev);
+            if (handle_ready_fd(fd, events[i].events)) continue;
+
+            /* One read() per wakeup; epoll is level-triggered, so anything
+             * beyond the batch is picked up on the next iteration */
+            int count = input_capture_read_fd(fd, input_frame, EVENT_BATCH);
+            loop_reads++;
+            if (count > 0) {
+                loop_events += (unsigned long long)count;
+                dispatch_batch(input_frame, count);
             }
         }
 
-        handle_periodic();
+        /* Everything produced by this batch goes out in one write();
+         * whatever the tty cannot take yet waits for EPOLLOUT. Threaded:
+         * one eventfd wake-up hands the batch to the transport thread.
+         * Local frames were written at their SYN_REPORT; a frame split
+         * across reads goes out here rather than waiting. */
+        transport_flush();
+        uinput_inject_flush();
+        apply_uinput_rebuild();
+        uart_update_epoll();
     }
 
 shutdown:
     printf("[MAIN] Shutting down...\n");
 
+    /* Don't leave a half-played sequence holding keys on the target */
+    sequence_finish_all();
+
     if (state_get() == STATE_REMOTE) {
         remote_release_all();
         Message msg;
         msg_switch(&msg, CONTROL_LOCAL);
-        uart_send(&msg);
+        transport_send(&msg);
+    }
+    if (use_uring) {
+        /* Let in-flight writes land before anything is written directly */
+        uring_loop_queue_writes();
+        uring_loop_cleanup();
     }
+    transport_flush();
+    print_stats();
+    transport_stop();
 
     if (epoll_fd >= 0) close(epoll_fd);
 
     uart_cleanup();
+    timer_cleanup();
     hotplug_cleanup();
     input_capture_cleanup();
     inhibit_cleanup();
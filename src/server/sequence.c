@@ -0,0 +1,105 @@
+#include "sequence.h"
+#include <string.h>
+#include "timer.h"
+#include "transport.h"
+
+#define SEQ_QUEUE_LEN 4
+
+static Sequence queue[SEQ_QUEUE_LEN];
+static int      queue_head  = 0;
+static int      queue_count = 0;
+static int      next_step   = 0;      /* in queue[queue_head] */
+static uint64_t start_ms    = 0;      /* when queue[queue_head] started */
+static int      seq_timer   = -1;
+
+/* Send every step of the head sequence that is due, then arm the timer
+ * for the next one or move on to the following sequence. */
+static void run_due(void) {
+    while (queue_count > 0) {
+        const Sequence *seq = &queue[queue_head];
+        uint64_t now = timer_now_ms();
+
+        while (next_step < seq->count && start_ms + seq->steps[next_step].at_ms <= now) {
+            transport_send(&seq->steps[next_step].msg);
+            next_step++;
+        }
+
+        if (next_step < seq->count) {
+            timer_arm(seq_timer, (uint32_t)(start_ms + seq->steps[next_step].at_ms - now), 0);
+            return;
+        }
+
+        queue_head = (queue_head + 1) % SEQ_QUEUE_LEN;
+        queue_count--;
+        next_step = 0;
+        start_ms  = timer_now_ms();
+    }
+}
+
+static void on_seq_timer(void *ctx) {
+    (void)ctx;
+    run_due();
+}
+
+int sequence_init(void) {
+    seq_timer = timer_create_slot(on_seq_timer, NULL);
+    return seq_timer < 0 ? -1 : 0;
+}
+
+void sequence_begin(Sequence *seq) {
+    seq->count     = 0;
+    seq->length_ms = 0;
+}
+
+int sequence_add(Sequence *seq, const Message *msg, uint32_t after_ms) {
+    if (seq->count >= SEQ_MAX_STEPS) return -1;
+    seq->length_ms += after_ms;
+    seq->steps[seq->count].msg   = *msg;
+    seq->steps[seq->count].at_ms = seq->length_ms;
+    seq->count++;
+    return 0;
+}
+
+int sequence_tap(Sequence *seq, const HIDKeyboardReport *report, uint32_t hold_ms) {
+    if (seq->count + 2 > SEQ_MAX_STEPS) return -1;
+
+    Message msg;
+    HIDKeyboardReport released;
+    memset(&released, 0, sizeof(released));
+
+    msg_keyboard_report(&msg, report);
+    sequence_add(seq, &msg, 0);
+    msg_keyboard_report(&msg, &released);
+    sequence_add(seq, &msg, hold_ms);
+    return 0;
+}
+
+int sequence_start(const Sequence *seq) {
+    if (queue_count >= SEQ_QUEUE_LEN || seq->count == 0) return -1;
+
+    queue[(queue_head + queue_count) % SEQ_QUEUE_LEN] = *seq;
+    queue_count++;
+    if (queue_count == 1) {
+        next_step = 0;
+        start_ms  = timer_now_ms();
+        run_due();
+    }
+    return 0;
+}
+
+int sequence_active(void) {
+    return queue_count > 0;
+}
+
+void sequence_finish_all(void) {
+    while (queue_count > 0) {
+        const Sequence *seq = &queue[queue_head];
+        for (; next_step < seq->count; next_step++) {
+            transport_send(&seq->steps[next_step].msg);
+        }
+        queue_head = (queue_head + 1) % SEQ_QUEUE_LEN;
+        queue_count--;
+        next_step = 0;
+    }
+    timer_cancel(seq_timer);
+}
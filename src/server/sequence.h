@@ -0,0 +1,46 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <stdint.h>
+#include "common/protocol.h"
+
+/* Timed HID sequences (press, hold N ms, release, ...) played out through
+ * the timer module, so the event loop never sleeps. Step times are
+ * offsets from the start of the sequence, so late wakeups do not add up.
+ * Sequences run one at a time in the order they were started. */
+#define SEQ_MAX_STEPS 16
+
+typedef struct {
+    Message  msg;
+    uint32_t at_ms;   /* offset from sequence start */
+} SequenceStep;
+
+typedef struct {
+    SequenceStep steps[SEQ_MAX_STEPS];
+    int      count;
+    uint32_t length_ms;   /* offset of the last step */
+} Sequence;
+
+/* Returns 0 on success, -1 if no timer slot is available. */
+int sequence_init(void);
+
+void sequence_begin(Sequence *seq);
+
+/* Append msg to be sent after_ms after the previous step.
+ * Returns 0, or -1 if the sequence is full. */
+int sequence_add(Sequence *seq, const Message *msg, uint32_t after_ms);
+
+/* Append press of `report`, hold for hold_ms, release all keys. */
+int sequence_tap(Sequence *seq, const HIDKeyboardReport *report, uint32_t hold_ms);
+
+/* Queue a sequence; steps due now are sent immediately.
+ * Returns 0, or -1 if too many sequences are pending. */
+int sequence_start(const Sequence *seq);
+
+int sequence_active(void);
+
+/* Send every remaining step right away (e.g. at shutdown, so nothing
+ * stays held on the target) and drop the queue. */
+void sequence_finish_all(void);
+
+#endif // SEQUENCE_H
@@ -0,0 +1,122 @@
+#include "timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#define MAX_TIMERS 16
+
+typedef struct {
+    timer_cb cb;
+    void    *ctx;
+    uint64_t deadline_ms;   /* 0 = disarmed */
+    uint32_t period_ms;
+} Timer;
+
+static Timer timers[MAX_TIMERS];
+static int   num_timers = 0;
+static int   tfd = -1;
+static uint64_t armed_ms = 0;   /* deadline the timerfd is set to, 0 = none */
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)ts.tv_nsec / 1000000ull;
+}
+
+/* Point the timerfd at the earliest deadline, or disarm it */
+static void rearm(void) {
+    uint64_t next = 0;
+    for (int i = 0; i < num_timers; i++) {
+        uint64_t d = timers[i].deadline_ms;
+        if (d && (next == 0 || d < next)) next = d;
+    }
+    if (tfd < 0 || next == armed_ms) return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (next) {
+        its.it_value.tv_sec  = (time_t)(next / 1000);
+        its.it_value.tv_nsec = (long)(next % 1000) * 1000000L;
+    }
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        perror("[TIMER] timerfd_settime");
+        return;
+    }
+    armed_ms = next;
+}
+
+int timer_init(void) {
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        perror("[TIMER] timerfd_create");
+        return -1;
+    }
+    return 0;
+}
+
+int timer_get_fd(void) {
+    return tfd;
+}
+
+int timer_create_slot(timer_cb cb, void *ctx) {
+    if (num_timers >= MAX_TIMERS) return -1;
+    timers[num_timers].cb          = cb;
+    timers[num_timers].ctx         = ctx;
+    timers[num_timers].deadline_ms = 0;
+    timers[num_timers].period_ms   = 0;
+    return num_timers++;
+}
+
+void timer_arm(int id, uint32_t delay_ms, uint32_t period_ms) {
+    if (id < 0 || id >= num_timers) return;
+    timers[id].deadline_ms = timer_now_ms() + delay_ms;
+    timers[id].period_ms   = period_ms;
+    rearm();
+}
+
+void timer_cancel(int id) {
+    if (id < 0 || id >= num_timers) return;
+    timers[id].deadline_ms = 0;
+    rearm();
+}
+
+int timer_pending(int id) {
+    if (id < 0 || id >= num_timers) return 0;
+    return timers[id].deadline_ms != 0;
+}
+
+void timer_process(void) {
+    uint64_t expirations;
+    if (read(tfd, &expirations, sizeof(expirations)) < 0) {
+        /* EAGAIN: a rearm() raced the wakeup; still check deadlines */
+    }
+    armed_ms = 0;
+
+    uint64_t now = timer_now_ms();
+    for (int i = 0; i < num_timers; i++) {
+        Timer *t = &timers[i];
+        if (!t->deadline_ms || t->deadline_ms > now) continue;
+
+        if (t->period_ms) {
+            /* Skip missed periods rather than firing them back to back */
+            do {
+                t->deadline_ms += t->period_ms;
+            } while (t->deadline_ms <= now);
+        } else {
+            t->deadline_ms = 0;
+        }
+        t->cb(t->ctx);   /* may re-arm or cancel any timer */
+    }
+    rearm();
+}
+
+void timer_cleanup(void) {
+    if (tfd >= 0) {
+        close(tfd);
+        tfd = -1;
+    }
+    num_timers = 0;
+    armed_ms   = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/* One-shot and periodic timers multiplexed onto a single timerfd
+ * (CLOCK_MONOTONIC, absolute deadlines, millisecond resolution).
+ * The timerfd is only armed for the earliest pending deadline, so the
+ * event loop can block in epoll_wait() indefinitely while nothing is due. */
+typedef void (*timer_cb)(void *ctx);
+
+/* Returns 0 on success, -1 on failure. */
+int timer_init(void);
+
+/* Returns the timerfd — add to epoll with EPOLLIN. */
+int timer_get_fd(void);
+
+/* Register a callback. Returns a timer id (>= 0) or -1 if the table is full.
+ * The timer starts disarmed. */
+int timer_create_slot(timer_cb cb, void *ctx);
+
+/* Fire after delay_ms, then every period_ms (0 = one-shot).
+ * Re-arming a pending timer moves its deadline. */
+void timer_arm(int id, uint32_t delay_ms, uint32_t period_ms);
+
+void timer_cancel(int id);
+
+int timer_pending(int id);
+
+/* Call when epoll reports the timerfd is readable: runs every expired
+ * callback and re-arms the timerfd for the next deadline. */
+void timer_process(void);
+
+uint64_t timer_now_ms(void);
+
+void timer_cleanup(void);
+
+#endif // TIMER_H
@@ -0,0 +1,337 @@
+#include "transport.h"
+#include "uart.h"
+#include "histogram.h"
+#include "latency.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define TRANSPORT_RING_SIZE  1024   /* messages; power of two          */
+#define STATS_WAIT_MS         500
+
+typedef struct {
+    Message  msg;
+    int8_t   cls;          /* LatencyClass of the origin, -1 = none */
+    uint64_t origin_us;
+    uint64_t enqueue_us;
+} TransportItem;
+
+static int threaded = 0;
+
+/* SPSC ring: the dispatch thread only advances tail, the transport
+ * thread only advances head. Each index lives on its own cache line. */
+static TransportItem ring[TRANSPORT_RING_SIZE];
+static alignas(64) _Atomic uint32_t ring_head = 0;
+static alignas(64) _Atomic uint32_t ring_tail = 0;
+
+static int       wake_fd  = -1;    /* eventfd: dispatch -> transport           */
+static int       space_fd = -1;    /* eventfd: transport -> dispatch, ring has room */
+static atomic_int space_wanted    = 0;
+static pthread_t thread;
+static atomic_int stop_requested  = 0;
+static atomic_int stats_requested = 0;
+
+/* Dispatch-thread state; the counters are read by print_thread_stats() */
+static int      pushed = 0;        /* since the last wake-up */
+static int8_t   cur_cls    = -1;
+static uint64_t cur_origin = 0;
+static _Atomic unsigned long long stat_kicks      = 0;
+static _Atomic unsigned long long stat_full_waits = 0;
+
+/* Transport-thread state */
+static unsigned long long stat_items   = 0;
+static unsigned long long stat_wakeups = 0;
+static unsigned long long depth_sum    = 0;
+static uint32_t           depth_max    = 0;
+static Histogram hist_handoff;     /* enqueue -> dequeued by the transport thread */
+static Histogram hist_write;       /* enqueue -> write() took the last byte       */
+
+static void kick(void) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("[TRANSPORT] eventfd write");
+    }
+    atomic_fetch_add_explicit(&stat_kicks, 1, memory_order_relaxed);
+}
+
+/* Move everything queued into the UART transmit ring */
+static void drain_ring(void) {
+    uint32_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    uint32_t depth = tail - head;
+    if (depth == 0) return;
+
+    depth_sum += depth;
+    if (depth > depth_max) depth_max = depth;
+
+    uint64_t now = latency_now_us();
+    int cls = -1;
+    for (; head != tail; head++) {
+        const TransportItem *it = &ring[head & (TRANSPORT_RING_SIZE - 1)];
+        hist_add(&hist_handoff, now - it->enqueue_us);
+        if (it->cls != cls) {
+            cls = it->cls;
+            uart_set_origin(cls, it->origin_us);
+        }
+        uart_set_enqueued(it->enqueue_us);
+        uart_send(&it->msg);
+        stat_items++;
+    }
+    uart_set_origin(-1, 0);
+    uart_set_enqueued(0);
+    atomic_store_explicit(&ring_head, head, memory_order_release);
+
+    /* Pairs with the fence in wait_for_space(): either the dispatch thread
+     * sees the new head, or we see its request and wake it */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange_explicit(&space_wanted, 0, memory_order_relaxed)) {
+        uint64_t one = 1;
+        if (write(space_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("[TRANSPORT] eventfd write");
+        }
+    }
+}
+
+/* uart.c calls this as write() moves past each stamped message */
+static void record_written(uint64_t enqueue_us, uint64_t written_us) {
+    hist_add(&hist_write, written_us - enqueue_us);
+}
+
+static void print_thread_stats(void) {
+    uart_print_stats();
+    printf("[TRANSPORT] threaded: %llu messages, %llu wake-ups sent, %llu handled",
+           stat_items, atomic_load_explicit(&stat_kicks, memory_order_relaxed), stat_wakeups);
+    if (stat_wakeups > 0) {
+        printf("; queue depth mean %.1f max %u", (double)depth_sum / (double)stat_wakeups,
+               depth_max);
+    }
+    printf("; %llu waits on a full queue\n",
+           atomic_load_explicit(&stat_full_waits, memory_order_relaxed));
+    hist_print("handoff", &hist_handoff);
+    hist_print("enq->write", &hist_write);
+}
+
+static void *transport_thread(void *arg) {
+    (void)arg;
+    int uart_fd = uart_get_fd();
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("[TRANSPORT] epoll_create1");
+        return NULL;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = wake_fd };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+    ev.data.fd = uart_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, uart_fd, &ev);
+    uint32_t uart_events = EPOLLIN;
+
+    for (;;) {
+        /* Lanes waiting for the tty to drain set the timeout */
+        struct epoll_event events[4];
+        int n = epoll_wait(epfd, events, 4, uart_retry_ms());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[TRANSPORT] epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == wake_fd) {
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) > 0) stat_wakeups++;
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                /* Signals are blocked here, so this reaches the main loop */
+                fprintf(stderr, "[TRANSPORT] UART error/hangup — exiting\n");
+                kill(getpid(), SIGTERM);
+                atomic_store(&stop_requested, 1);
+            } else if (events[i].events & EPOLLIN) {
+                uart_receive();
+            }
+        }
+
+        drain_ring();
+        uart_flush();
+
+        uint32_t want = EPOLLIN | (uart_tx_pending() ? EPOLLOUT : 0);
+        if (want != uart_events) {
+            ev.events  = want;
+            ev.data.fd = uart_fd;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, uart_fd, &ev);
+            uart_events = want;
+        }
+
+        if (atomic_load(&stats_requested)) {
+            print_thread_stats();
+            atomic_store(&stats_requested, 0);
+        }
+        if (atomic_load(&stop_requested)) {
+            drain_ring();
+            uart_flush();
+            break;
+        }
+    }
+
+    close(epfd);
+    return NULL;
+}
+
+static int pin_thread(pthread_t t, int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(t, sizeof(set), &set);
+    if (rc != 0) {
+        fprintf(stderr, "[TRANSPORT] Cannot pin to CPU %d: %s\n", cpu, strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+int transport_pin_self(int cpu) {
+    return pin_thread(pthread_self(), cpu);
+}
+
+int transport_init(int use_thread, int cpu) {
+    hist_reset(&hist_handoff);
+    hist_reset(&hist_write);
+    if (!use_thread) return 0;
+
+    wake_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0 || space_fd < 0) {
+        perror("[TRANSPORT] eventfd");
+        if (wake_fd >= 0) close(wake_fd);
+        if (space_fd >= 0) close(space_fd);
+        wake_fd = space_fd = -1;
+        return -1;
+    }
+
+    uart_set_written_hook(record_written);
+
+    /* The thread inherits a fully blocked signal mask so SIGINT, SIGTERM
+     * and SIGUSR1 keep interrupting the main loop's epoll_wait() */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&thread, NULL, transport_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "[TRANSPORT] pthread_create: %s\n", strerror(rc));
+        uart_set_written_hook(NULL);
+        close(wake_fd);
+        close(space_fd);
+        wake_fd = space_fd = -1;
+        return -1;
+    }
+
+    threaded = 1;
+    if (cpu >= 0 && pin_thread(thread, cpu) == 0) {
+        printf("[TRANSPORT] UART writes on a dedicated thread pinned to CPU %d\n", cpu);
+    } else {
+        printf("[TRANSPORT] UART writes on a dedicated thread\n");
+    }
+    return 0;
+}
+
+int transport_threaded(void) {
+    return threaded;
+}
+
+void transport_set_origin(int cls, uint64_t dispatch_us) {
+    if (!threaded) {
+        uart_set_origin(cls, dispatch_us);
+        return;
+    }
+    cur_cls    = (int8_t)cls;
+    cur_origin = dispatch_us;
+}
+
+static int ring_full(uint32_t tail) {
+    return tail - atomic_load_explicit(&ring_head, memory_order_acquire) == TRANSPORT_RING_SIZE;
+}
+
+/* Full: the transport thread is behind by a whole ring. Sleep until it
+ * frees a slot rather than drop input or spin against it for the CPU. */
+static void wait_for_space(uint32_t tail) {
+    atomic_fetch_add_explicit(&stat_full_waits, 1, memory_order_relaxed);
+    kick();
+    while (ring_full(tail)) {
+        atomic_store_explicit(&space_wanted, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!ring_full(tail)) break;
+
+        /* The timeout only guards against a transport thread that died */
+        struct pollfd pfd = { .fd = space_fd, .events = POLLIN };
+        if (poll(&pfd, 1, STATS_WAIT_MS) > 0) {
+            uint64_t count;
+            if (read(space_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("[TRANSPORT] eventfd read");
+            }
+        }
+    }
+    atomic_store_explicit(&space_wanted, 0, memory_order_relaxed);
+}
+
+void transport_send(const Message *msg) {
+    if (!threaded) {
+        uart_send(msg);
+        return;
+    }
+
+    uint32_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    if (ring_full(tail)) wait_for_space(tail);
+
+    TransportItem *it = &ring[tail & (TRANSPORT_RING_SIZE - 1)];
+    it->msg        = *msg;
+    it->cls        = cur_cls;
+    it->origin_us  = cur_origin;
+    it->enqueue_us = latency_now_us();
+    atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+    pushed++;
+}
+
+void transport_flush(void) {
+    if (!threaded) {
+        uart_flush();
+        return;
+    }
+    if (pushed) {
+        kick();
+        pushed = 0;
+    }
+}
+
+void transport_print_stats(void) {
+    if (!threaded) {
+        uart_print_stats();
+        return;
+    }
+    atomic_store(&stats_requested, 1);
+    kick();
+    for (int i = 0; i < STATS_WAIT_MS && atomic_load(&stats_requested); i++) {
+        usleep(1000);
+    }
+}
+
+void transport_stop(void) {
+    if (!threaded) return;
+    atomic_store(&stop_requested, 1);
+    kick();
+    pthread_join(thread, NULL);
+    uart_set_written_hook(NULL);
+    close(wake_fd);
+    close(space_fd);
+    wake_fd  = space_fd = -1;
+    threaded = 0;
+}
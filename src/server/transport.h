@@ -0,0 +1,44 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+#include "common/protocol.h"
+
+/* Hand-off between input dispatch and the UART.
+ *
+ * Inline mode (default): every call goes straight to uart_*() on the
+ * calling thread, as before.
+ *
+ * Threaded mode: a transport thread owns the UART fd (writes, EPOLLOUT,
+ * probe echoes). The dispatch thread pushes messages into a lock-free
+ * single-producer/single-consumer ring and wakes it through an eventfd
+ * once per event-loop iteration, so a slow tty write never delays the
+ * next evdev read. Only the dispatch thread may call transport_send(),
+ * transport_set_origin() and transport_flush(). */
+
+/* Call after uart_init(). cpu >= 0 pins the transport thread to that core.
+ * Returns 0 on success, -1 if the thread could not be started. */
+int  transport_init(int threaded, int cpu);
+
+int  transport_threaded(void);
+
+/* Same contract as uart_send() / uart_set_origin(). */
+void transport_send(const Message *msg);
+void transport_set_origin(int cls, uint64_t dispatch_us);
+
+/* Inline: uart_flush(). Threaded: wake the transport thread if anything
+ * was queued since the last call. */
+void transport_flush(void);
+
+/* uart_print_stats(), plus queue depth and enqueue-to-write latency in
+ * threaded mode (printed by the transport thread; waits for it). */
+void transport_print_stats(void);
+
+/* Threaded: send everything still queued, stop and join the thread.
+ * The UART is then owned by the caller again. */
+void transport_stop(void);
+
+/* Pin the calling thread to a core. Returns 0 on success. */
+int  transport_pin_self(int cpu);
+
+#endif // TRANSPORT_H
@@ -1,67 +1,970 @@
 #include "uart.h"
+#include "histogram.h"
+#include "latency.h"
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <asm/termbits.h>   /* struct termios2, BOTHER — not mixable with <termios.h> */
+
+#define UART_TX_BUF_SIZE   4096   /* bounded transmit ring                 */
+#define UART_DRAIN_MS       500   /* max wait for pending bytes on cleanup */
+#define HELLO_TIMEOUT_MS    100   /* wait for MSG_HELLO_ACK per attempt    */
+#define HELLO_ATTEMPTS        3
+#define BAUD_SETTLE_MS       20   /* let both ends reprogram their UARTs   */
+#define BAUD_PROBE_MS       500   /* firmware reverts if silent this long  */
+#define LATENCY_PROBE_MS    100   /* at most one latency probe this often  */
+#define LATENCY_SLOTS        16   /* probes in flight                      */
+#define WRITE_MARKS         256   /* timed messages awaiting write()       */
+#define URGENT_LANE_LEN     128   /* key/button/switch messages waiting    */
+#define COMMIT_AHEAD_MS       2   /* wire time committed ahead (tty+ring)  */
 
 static int uart_fd = -1;
 
-int uart_init(const char *port, int baud_rate) {
-    uart_fd = open(port, O_RDWR | O_NOCTTY | O_SYNC);
-    if (uart_fd < 0) {
-        perror("Failed to open UART device");
+/* Negotiated peer. Without a handshake reply the firmware is assumed to
+ * be version 1: fixed 9-byte messages, no framing, no MSG_MOUSE_REPORT. */
+static struct {
+    int      legacy;
+    uint8_t  version;
+    uint16_t features;      /* MSG_FEAT_* both sides support */
+    uint32_t max_baud;
+    uint16_t queue_depth;
+    int      baud;          /* current rate                  */
+    int      initial_baud;  /* rate the firmware boots with  */
+    int      flow_control;
+} peer;
+
+/* Everything the firmware sends: handshake replies interleaved with its
+ * console log (UART0 carries both); anything that is not a valid frame
+ * is counted and discarded. */
+static MsgParser rx_parser;
+
+/* Latency probes: uart_send() follows an input message with a
+ * MSG_LATENCY_PROBE and remembers when. The firmware echoes it once the
+ * HID report carrying that input has completed on USB, along with how
+ * long that took on its side; the rest of the round trip is the UART. */
+static struct {
+    uint16_t           id;
+    unsigned long long sent_ns;   /* 0 = slot free */
+} probes[LATENCY_SLOTS];
+static uint16_t           probe_next_id = 0;
+static unsigned long long probe_last_ns = 0;
+static Histogram hist_uart;    /* round trip minus firmware time */
+static Histogram hist_usb;     /* firmware: probe parsed -> HID report complete */
+static Histogram hist_total;   /* uart_send() -> echo received */
+
+/* Dispatch-to-write latency: messages queued while an origin or an
+ * enqueue stamp is set get a mark holding the ring byte position where
+ * they end; once write() has moved past that position the elapsed time is
+ * recorded (and the enqueue stamp handed to written_hook). */
+static struct {
+    unsigned long long end;
+    uint64_t           origin_us;
+    uint64_t           enqueue_us;   /* 0 = none */
+    int8_t             cls;          /* -1 = no dispatch timing */
+} marks[WRITE_MARKS];
+static unsigned           mark_head  = 0;
+static unsigned           mark_count = 0;
+static unsigned long long tx_total_queued  = 0;   /* bytes ever put in the ring */
+static unsigned long long tx_total_written = 0;   /* bytes ever written         */
+static int      origin_cls = -1;
+static uint64_t origin_us  = 0;
+static uint64_t origin_enqueue_us = 0;
+static void   (*written_hook)(uint64_t enqueue_us, uint64_t written_us) = NULL;
+static unsigned long long stat_marks_lost = 0;   /* timed messages past WRITE_MARKS */
+
+/* Button state last sent as separate MSG_MOUSE_BUTTON messages when a
+ * mouse report has to be split for firmware without MSG_MOUSE_REPORT. */
+static uint8_t split_buttons = 0;
+
+/* 6KRO report last sent for firmware without MSG_KEYBOARD_BITMAP; the
+ * key bitmap is folded into it so held keys keep their slots. */
+static HIDKeyboardReport split_keys;
+
+/* Transmit ring: frames accumulate here until uart_flush() moves them
+ * into the tty. The fd is non-blocking, so whatever the tty cannot take
+ * right now stays queued until the fd reports EPOLLOUT. */
+static uint8_t tx_ring[UART_TX_BUF_SIZE];
+static size_t  tx_head  = 0;   /* next byte to write to the fd */
+static size_t  tx_count = 0;   /* bytes queued                 */
+
+/* Send lanes: uart_send() only queues here; uart_flush() commits to the
+ * ring no more than COMMIT_AHEAD_MS of wire time beyond what the tty
+ * still holds (TIOCOUTQ). Everything else waits where it can still be
+ * reordered: keyboard reports, button changes and mode switches (urgent
+ * lane, FIFO) always go before motion, and motion and wheel deltas are
+ * merged into one pending record, so a click never queues behind a
+ * backlog of mouse moves. The motion queued before a click still goes
+ * out first: inside the click's report, or, for firmware that takes
+ * separate button messages, moved into the urgent lane ahead of it. */
+typedef struct {
+    Message  msg;
+    int8_t   cls;          /* origin for dispatch-to-write timing, -1 = none */
+    uint64_t origin_us;
+    uint64_t enqueue_us;   /* transport enqueue stamp, 0 = none */
+} LaneEntry;
+
+static LaneEntry urgent[URGENT_LANE_LEN];
+static unsigned  urgent_head  = 0;
+static unsigned  urgent_count = 0;
+
+static struct {
+    int      pending;
+    int      dx, dy;
+    int      wheel_v, wheel_h;
+    int8_t   cls;          /* origin of the oldest merged message */
+    uint64_t origin_us;
+    uint64_t enqueue_us;
+} motion;
+
+static uint8_t lane_buttons = 0;   /* buttons of the latest MSG_MOUSE_REPORT */
+static int     probe_due    = 0;   /* latency probe waits for empty lanes   */
+static int     commit_all   = 0;   /* cleanup: no pacing, flush everything  */
+
+/* Bytes believed to sit in the tty/driver queue, drained at the line
+ * rate between TIOCOUTQ readings so the ioctl is only needed when the
+ * estimate says the commit budget is used up. */
+static unsigned long long wire_bytes    = 0;
+static unsigned long long wire_ns       = 0;
+static unsigned long long bytes_per_sec = 0;   /* 10 bits per byte on the wire */
+static size_t             commit_limit  = 0;
+
+/* Counters for uart_print_stats() */
+static unsigned long long stat_messages = 0;
+static unsigned long long stat_writes   = 0;
+static unsigned long long stat_write_ns = 0;
+static unsigned long long stat_merged   = 0;
+static unsigned long long stat_overtook = 0;   /* urgent sent ahead of motion */
+static unsigned long long stat_dropped  = 0;
+static unsigned long long stat_lost_buttons = 0;   /* button changes among the dropped */
+static unsigned long long stat_outq     = 0;   /* TIOCOUTQ readings           */
+static unsigned long long stat_rollover = 0;   /* 6KRO reports missing keys   */
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static int16_t clamp16(int v) {
+    return (int16_t)(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+}
+
+static int8_t clamp8(int v) {
+    return (int8_t)(v > 127 ? 127 : v < -128 ? -128 : v);
+}
+
+static void set_pacing(int baud) {
+    bytes_per_sec = (unsigned long long)baud / 10;
+    commit_limit  = (size_t)(bytes_per_sec * COMMIT_AHEAD_MS / 1000);
+    if (commit_limit < 2 * MSG_FRAME_MAX) commit_limit = 2 * MSG_FRAME_MAX;
+}
+
+/* Configure 8N1 raw mode at an arbitrary rate. termios2 with BOTHER
+ * passes the rate to the driver as a plain integer, so any rate the
+ * USB-serial bridge supports works, not just the Bxxx constants. */
+static int configure_port(int baud_rate, int flow_control) {
+    struct termios2 tio;
+    if (ioctl(uart_fd, TCGETS2, &tio) != 0) {
+        perror("TCGETS2 failed");
         return -1;
     }
 
-    speed_t baud;
-    switch (baud_rate) {
-        case 230400: baud = B230400; break;
-        case 460800: baud = B460800; break;
-        case 921600: baud = B921600; break;
-        default:     baud = B115200; break;
+    tio.c_cflag &= ~(tcflag_t)(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = (speed_t)baud_rate;
+    tio.c_ospeed = (speed_t)baud_rate;
+
+    tio.c_cflag &= ~(tcflag_t)(PARENB | CSTOPB | CSIZE | CRTSCTS);
+    tio.c_cflag |= CS8 | CREAD | CLOCAL;
+    if (flow_control) tio.c_cflag |= CRTSCTS;
+    tio.c_lflag &= ~(tcflag_t)(ICANON | ECHO | ECHOE | ECHONL | ISIG | IEXTEN);
+    tio.c_iflag &= ~(tcflag_t)(IXON | IXOFF | IXANY | ICRNL | INLCR | IGNCR | ISTRIP | BRKINT);
+    tio.c_oflag &= ~(tcflag_t)OPOST;
+    tio.c_cc[VMIN]  = 0;
+    tio.c_cc[VTIME] = 0;
+
+    if (ioctl(uart_fd, TCSETS2, &tio) != 0) {
+        perror("TCSETS2 failed");
+        return -1;
     }
 
-    struct termios tty;
-    if (tcgetattr(uart_fd, &tty) != 0) {
-        perror("tcgetattr failed");
-        close(uart_fd);
-        uart_fd = -1;
+    /* Drivers may round to the nearest rate their divider supports */
+    if (ioctl(uart_fd, TCGETS2, &tio) == 0 && tio.c_ospeed != (speed_t)baud_rate) {
+        fprintf(stderr, "[UART] Requested %d baud, driver set %u\n",
+                baud_rate, (unsigned)tio.c_ospeed);
+    }
+    if (flow_control && !(tio.c_cflag & CRTSCTS)) {
+        fprintf(stderr, "[UART] Driver does not support RTS/CTS flow control\n");
         return -1;
     }
+    return 0;
+}
+
+static long long now_ms(void) {
+    return (long long)(now_ns() / 1000000ull);
+}
+
+/* Blocking write used only during the handshake, before the event loop */
+static int write_all(const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(uart_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) return -1;
+            struct pollfd pfd = { .fd = uart_fd, .events = POLLOUT };
+            if (poll(&pfd, 1, UART_DRAIN_MS) <= 0) return -1;
+            continue;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Send a frame preceded by a delimiter, so any partial frame or stray
+ * bytes ahead of it in the firmware's parser are discarded. */
+static int send_control(const Message *msg) {
+    uint8_t buf[1 + MSG_FRAME_MAX];
+    buf[0] = MSG_FRAME_DELIM;
+    return write_all(buf, 1 + msg_frame_encode(msg, buf + 1));
+}
 
-    cfsetospeed(&tty, baud);
-    cfsetispeed(&tty, baud);
+/* Wait up to timeout_ms for a frame of the given type. */
+static int wait_for(uint8_t type, int timeout_ms, Message *out) {
+    long long deadline = now_ms() + timeout_ms;
 
-    tty.c_cflag &= ~(PARENB | CSTOPB | CSIZE | CRTSCTS);
-    tty.c_cflag |= CS8 | CREAD | CLOCAL;
-    tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHONL | ISIG);
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
-    tty.c_oflag &= ~OPOST;
-    tty.c_cc[VMIN]  = 0;
-    tty.c_cc[VTIME] = 10;
+    for (;;) {
+        long long left = deadline - now_ms();
+        if (left <= 0) return -1;
 
-    if (tcsetattr(uart_fd, TCSANOW, &tty) != 0) {
-        perror("tcsetattr failed");
+        struct pollfd pfd = { .fd = uart_fd, .events = POLLIN };
+        int r = poll(&pfd, 1, (int)left);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+
+        uint8_t buf[256];
+        ssize_t n = read(uart_fd, buf, sizeof(buf));
+        for (ssize_t i = 0; i < n; i++) {
+            if (msg_parser_feed(&rx_parser, buf[i], out) && out->type == type) return 0;
+        }
+    }
+}
+
+/* MSG_HELLO wrapped for version-1 firmware, which reads fixed 9-byte
+ * messages and never resynchronises: a leading 0x00 makes it skip the
+ * whole 9-byte block as an unknown type, while framed firmware sees a
+ * delimiter, the HELLO frame and idle fill. */
+static int send_hello(uint16_t features) {
+    uint8_t block[MSG_LEGACY_SIZE] = { MSG_FRAME_DELIM };
+    Message msg;
+    msg_hello(&msg, features);
+    if (1 + msg_frame_encode(&msg, block + 1) > sizeof(block)) return -1;
+    return write_all(block, sizeof(block));
+}
+
+static int handshake(uint16_t features) {
+    Message reply;
+    for (int i = 0; i < HELLO_ATTEMPTS; i++) {
+        if (send_hello(features) != 0) return -1;
+        if (wait_for(MSG_HELLO_ACK, HELLO_TIMEOUT_MS, &reply) == 0) {
+            peer.legacy      = 0;
+            peer.version     = reply.data.hello.version;
+            peer.features    = features & reply.data.hello.features;
+            peer.max_baud    = reply.data.hello.max_baud;
+            peer.queue_depth = reply.data.hello.queue_depth;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Ask the firmware to move to a faster rate. It confirms at the old rate,
+ * switches, and falls back on its own unless a frame arrives at the new
+ * rate within BAUD_PROBE_MS — so a rate the bridge cannot do costs one
+ * probe and leaves both ends where they started. */
+static int switch_baud(int rate, uint16_t features) {
+    Message msg, reply;
+    msg_set_baud(&msg, (uint32_t)rate);
+    if (send_control(&msg) != 0 ||
+        wait_for(MSG_SET_BAUD, HELLO_TIMEOUT_MS, &reply) != 0 ||
+        reply.data.baud.rate != (uint32_t)rate) {
+        fprintf(stderr, "[UART] Firmware declined %d baud\n", rate);
+        return -1;
+    }
+
+    ioctl(uart_fd, TCSBRK, 1);   /* tcdrain() */
+    if (configure_port(rate, peer.flow_control) == 0) {
+        usleep(BAUD_SETTLE_MS * 1000);
+        ioctl(uart_fd, TCFLSH, TCIFLUSH);
+        if (handshake(features) == 0) {
+            peer.baud = rate;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "[UART] No reply at %d baud, staying at %d\n", rate, peer.baud);
+    configure_port(peer.baud, peer.flow_control);
+    usleep((BAUD_PROBE_MS + 100) * 1000);
+    ioctl(uart_fd, TCFLSH, TCIFLUSH);
+    handshake(features);
+    return -1;
+}
+
+int uart_init(const char *port, int baud_rate, int flow_control, int max_baud) {
+    uart_fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (uart_fd < 0) {
+        perror("Failed to open UART device");
+        return -1;
+    }
+
+    if (configure_port(baud_rate, flow_control) != 0) {
         close(uart_fd);
         uart_fd = -1;
         return -1;
     }
 
-    printf("[UART] Initialized %s at %d baud\n", port, baud_rate);
+    tx_head  = 0;
+    tx_count = 0;
+    urgent_head  = 0;
+    urgent_count = 0;
+    memset(&motion, 0, sizeof(motion));
+    lane_buttons = 0;
+    probe_due    = 0;
+    wire_bytes   = 0;
+    wire_ns      = now_ns();
+    msg_parser_init(&rx_parser);
+    memset(&peer, 0, sizeof(peer));
+    peer.legacy       = 1;
+    peer.version      = 1;
+    peer.baud         = baud_rate;
+    peer.initial_baud = baud_rate;
+    peer.flow_control = flow_control;
+    split_buttons     = 0;
+    memset(&split_keys, 0, sizeof(split_keys));
+
+    memset(probes, 0, sizeof(probes));
+    hist_reset(&hist_uart);
+    hist_reset(&hist_usb);
+    hist_reset(&hist_total);
+
+    uint16_t features = MSG_FEAT_MOUSE_REPORT | MSG_FEAT_BAUD_SWITCH | MSG_FEAT_LATENCY_PROBE |
+                        MSG_FEAT_NKRO | (flow_control ? MSG_FEAT_FLOW_CONTROL : 0);
+    ioctl(uart_fd, TCFLSH, TCIFLUSH);   /* discard console output from before we started */
+
+    /* Only the boot rate is ever tried here: the peer may be version-1
+     * firmware, which never resynchronises, so nothing may reach it at a
+     * rate it is not listening at. A faster rate is probed only after an
+     * ACK has shown the firmware is framed (switch_baud below). */
+    int found = handshake(features) == 0;
+    if (!found && max_baud > baud_rate) {
+        /* A crashed session may have left framed firmware at a faster
+         * rate. Our boot-rate HELLOs reach it as framing errors, on which
+         * it falls back to the boot rate by itself; ask once more. */
+        usleep(BAUD_SETTLE_MS * 1000);
+        ioctl(uart_fd, TCFLSH, TCIFLUSH);
+        found = handshake(features) == 0;
+    }
+
+    if (!found) {
+        printf("[UART] No handshake reply — assuming version-1 firmware "
+               "(fixed %d-byte messages)\n", MSG_LEGACY_SIZE);
+    } else {
+        printf("[UART] Firmware protocol v%u, features 0x%04x, max %u baud, HID queue %u\n",
+               peer.version, peer.features, (unsigned)peer.max_baud, peer.queue_depth);
+        if (flow_control && !(peer.features & MSG_FEAT_FLOW_CONTROL)) {
+            fprintf(stderr, "[UART] Warning: firmware has RTS/CTS disabled\n");
+        }
+
+        int target = max_baud < (int)peer.max_baud ? max_baud : (int)peer.max_baud;
+        if ((peer.features & MSG_FEAT_BAUD_SWITCH) && target > peer.baud) {
+            switch_baud(target, features);
+        }
+    }
+
+    set_pacing(peer.baud);
+    printf("[UART] Initialized %s at %d baud%s\n", port, peer.baud,
+           flow_control ? ", RTS/CTS flow control" : "");
+    return 0;
+}
+
+int uart_get_fd(void) {
+    return uart_fd;
+}
+
+static void add_mark(int cls, uint64_t origin, uint64_t enqueued) {
+    if (cls < 0 && enqueued == 0) return;
+    if (mark_count >= WRITE_MARKS) {
+        stat_marks_lost++;
+        return;
+    }
+    unsigned slot = (mark_head + mark_count) % WRITE_MARKS;
+    marks[slot].end        = tx_total_queued;
+    marks[slot].origin_us  = origin;
+    marks[slot].enqueue_us = enqueued;
+    marks[slot].cls        = (int8_t)cls;
+    mark_count++;
+}
+
+/* Age the tty queue estimate by the time since it was last updated */
+static void wire_decay(void) {
+    unsigned long long now = now_ns();
+    unsigned long long sent = (now - wire_ns) * bytes_per_sec / 1000000000ull;
+    wire_bytes = sent < wire_bytes ? wire_bytes - sent : 0;
+    wire_ns = now;
+}
+
+/* Bytes that may still be committed to the ring right now */
+static long commit_room(void) {
+    if (commit_all) return (long)(sizeof(tx_ring) - tx_count);
+
+    wire_decay();
+    if (tx_count + wire_bytes >= commit_limit) {
+        /* The estimate says full; ask the driver before waiting */
+        int outq;
+        if (ioctl(uart_fd, TIOCOUTQ, &outq) == 0) {
+            wire_bytes = outq > 0 ? (unsigned long long)outq : 0;
+            stat_outq++;
+        }
+    }
+    return (long)commit_limit - (long)tx_count - (long)wire_bytes;
+}
+
+/* Encode msg into the ring if it fits in *room. Returns 0 or -1. */
+static int commit(const Message *msg, int cls, uint64_t origin, uint64_t enqueued,
+                  long *room) {
+    uint8_t frame[MSG_FRAME_MAX];
+    size_t len = peer.legacy ? msg_legacy_encode(msg, frame) : msg_frame_encode(msg, frame);
+    if (len == 0) return 0;
+    if ((long)len > *room || len > sizeof(tx_ring) - tx_count) return -1;
+
+    size_t tail  = (tx_head + tx_count) % sizeof(tx_ring);
+    size_t first = sizeof(tx_ring) - tail;
+    if (first > len) first = len;
+    memcpy(tx_ring + tail, frame, first);
+    memcpy(tx_ring, frame + first, len - first);
+    tx_count += len;
+    tx_total_queued += len;
+    *room -= (long)len;
+    add_mark(cls, origin, enqueued);
     return 0;
 }
 
+static int lanes_pending(void) {
+    return urgent_count > 0 || motion.pending || probe_due;
+}
+
+/* Take up to one message's worth out of the motion record. Firmware
+ * without MSG_MOUSE_REPORT gets separate move and wheel messages. */
+static void motion_message(Message *msg) {
+    if (peer.features & MSG_FEAT_MOUSE_REPORT) {
+        msg_mouse_report(msg, lane_buttons, clamp16(motion.dx), clamp16(motion.dy),
+                         clamp8(motion.wheel_v), clamp8(motion.wheel_h));
+    } else if (motion.dx != 0 || motion.dy != 0) {
+        msg_mouse_move(msg, clamp16(motion.dx), clamp16(motion.dy));
+    } else {
+        msg_mouse_wheel(msg, clamp16(motion.wheel_v), clamp16(motion.wheel_h));
+    }
+}
+
+static void motion_consumed(const Message *msg) {
+    switch (msg->type) {
+        case MSG_MOUSE_REPORT:
+            motion.dx      -= msg->data.mouse_report.dx;
+            motion.dy      -= msg->data.mouse_report.dy;
+            motion.wheel_v -= msg->data.mouse_report.vertical;
+            motion.wheel_h -= msg->data.mouse_report.horizontal;
+            break;
+        case MSG_MOUSE_MOVE:
+            motion.dx -= msg->data.mouse_move.dx;
+            motion.dy -= msg->data.mouse_move.dy;
+            break;
+        default:
+            motion.wheel_v -= msg->data.mouse_wheel.vertical;
+            motion.wheel_h -= msg->data.mouse_wheel.horizontal;
+            break;
+    }
+    motion.pending = (motion.dx != 0 || motion.dy != 0 ||
+                      motion.wheel_v != 0 || motion.wheel_h != 0);
+}
+
+/* Move lane contents into the ring, urgent first, within the budget */
+static void commit_lanes(void) {
+    if (!lanes_pending()) return;
+    long room = commit_room();
+
+    while (urgent_count > 0) {
+        const LaneEntry *e = &urgent[urgent_head];
+        if (commit(&e->msg, e->cls, e->origin_us, e->enqueue_us, &room) < 0) return;
+        if (motion.pending) stat_overtook++;
+        urgent_head = (urgent_head + 1) % URGENT_LANE_LEN;
+        urgent_count--;
+    }
+    while (motion.pending) {
+        Message msg;
+        motion_message(&msg);
+        if (commit(&msg, motion.cls, motion.origin_us, motion.enqueue_us, &room) < 0) return;
+        motion_consumed(&msg);
+        motion.cls        = -1;   /* the rest of a split record is not timed */
+        motion.enqueue_us = 0;
+    }
+    if (probe_due) {
+        Message msg;
+        uint16_t id = probe_next_id;
+        msg_latency_probe(&msg, id, 0);
+        if (commit(&msg, -1, 0, 0, &room) < 0) return;
+        probe_next_id++;
+        probes[id % LATENCY_SLOTS].id      = id;
+        probes[id % LATENCY_SLOTS].sent_ns = now_ns();
+        probe_due = 0;
+    }
+}
+
+static void complete_marks(void) {
+    uint64_t now = 0;
+    while (mark_count > 0 && marks[mark_head].end <= tx_total_written) {
+        if (now == 0) now = latency_now_us();
+        if (marks[mark_head].cls >= 0) {
+            latency_record(LAT_DISPATCH_TO_WRITE, (LatencyClass)marks[mark_head].cls,
+                           now - marks[mark_head].origin_us);
+        }
+        if (marks[mark_head].enqueue_us != 0 && written_hook) {
+            written_hook(marks[mark_head].enqueue_us, now);
+        }
+        mark_head = (mark_head + 1) % WRITE_MARKS;
+        mark_count--;
+    }
+}
+
+int uart_tx_peek(struct iovec iov[2]) {
+    if (uart_fd < 0) return 0;
+    commit_lanes();
+    if (tx_count == 0) return 0;
+
+    size_t first = sizeof(tx_ring) - tx_head;
+    if (first > tx_count) first = tx_count;
+    iov[0].iov_base = tx_ring + tx_head;
+    iov[0].iov_len  = first;
+    iov[1].iov_base = tx_ring;
+    iov[1].iov_len  = tx_count - first;
+    return iov[1].iov_len ? 2 : 1;
+}
+
+void uart_tx_advance(size_t n) {
+    stat_writes++;
+    if (n > tx_count) n = tx_count;
+    tx_head   = (tx_head + n) % sizeof(tx_ring);
+    tx_count -= n;
+    if (tx_count == 0) tx_head = 0;
+    tx_total_written += (unsigned long long)n;
+    wire_decay();
+    wire_bytes += (unsigned long long)n;
+    complete_marks();
+}
+
+void uart_flush(void) {
+    if (uart_fd < 0) return;
+
+    unsigned long long start = now_ns();
+    int wrote = 0;
+    struct iovec iov[2];
+    int iovcnt;
+
+    while ((iovcnt = uart_tx_peek(iov)) > 0) {
+        ssize_t n = writev(uart_fd, iov, iovcnt);
+        wrote = 1;
+        if (n < 0) {
+            stat_writes++;
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) {
+                fprintf(stderr, "[UART] Write error: %s\n", strerror(errno));
+            }
+            break;
+        }
+        uart_tx_advance((size_t)n);
+    }
+
+    if (wrote) stat_write_ns += now_ns() - start;
+}
+
+int uart_tx_pending(void) {
+    return tx_count > 0;
+}
+
+int uart_retry_ms(void) {
+    if (uart_fd < 0 || !lanes_pending()) return -1;
+    if (bytes_per_sec == 0) return 1;
+
+    /* Until the queue ahead has drained enough for one more frame */
+    wire_decay();
+    unsigned long long ahead = tx_count + wire_bytes + MSG_FRAME_MAX;
+    unsigned long long over  = ahead > commit_limit ? ahead - commit_limit : 0;
+    unsigned long long ms    = (over * 1000ull + bytes_per_sec - 1) / bytes_per_sec;
+    return ms < 1 ? 1 : (int)ms;
+}
+
+/* A queued entry with buttons that differ from what follows it: motion
+ * must not be merged across it, or it would move to the other side of
+ * the click. */
+static int is_button_edge(const Message *msg, const Message *next) {
+    if (msg->type == MSG_MOUSE_BUTTON) return 1;
+    return msg->type == MSG_MOUSE_REPORT &&
+           (next->type != MSG_MOUSE_REPORT ||
+            msg->data.mouse_report.buttons != next->data.mouse_report.buttons);
+}
+
+/* Urgent lane full (the link is gone or far too slow). Motion and wheel
+ * deltas are added to the newest entry that can take them, as long as
+ * no button change lies in between; keyboard reports and mode switches
+ * keep only the latest state. A button change has nothing to merge
+ * into without losing the press or release, so it is dropped and
+ * counted; a report's deltas go to the motion record, whose next report
+ * then carries the new buttons (lane_buttons) as well. */
+static void urgent_merge(const LaneEntry *entry) {
+    const Message *msg = &entry->msg;
+    int button_change = msg->type == MSG_MOUSE_BUTTON;
+
+    for (unsigned i = urgent_count; i-- > 0;) {
+        LaneEntry *e = &urgent[(urgent_head + i) % URGENT_LANE_LEN];
+        Message *q = &e->msg;
+
+        switch (msg->type) {
+            case MSG_MOUSE_MOVE:
+            case MSG_MOUSE_WHEEL:
+                if (is_button_edge(q, msg)) break;
+                if (q->type != msg->type) continue;
+                if (msg->type == MSG_MOUSE_MOVE) {
+                    q->data.mouse_move.dx = clamp16(q->data.mouse_move.dx + msg->data.mouse_move.dx);
+                    q->data.mouse_move.dy = clamp16(q->data.mouse_move.dy + msg->data.mouse_move.dy);
+                } else {
+                    q->data.mouse_wheel.vertical =
+                        clamp16(q->data.mouse_wheel.vertical + msg->data.mouse_wheel.vertical);
+                    q->data.mouse_wheel.horizontal =
+                        clamp16(q->data.mouse_wheel.horizontal + msg->data.mouse_wheel.horizontal);
+                }
+                stat_merged++;
+                return;
+            case MSG_MOUSE_REPORT:
+                if (q->type == MSG_MOUSE_BUTTON) break;
+                if (q->type != MSG_MOUSE_REPORT) continue;
+                if (q->data.mouse_report.buttons != msg->data.mouse_report.buttons) {
+                    button_change = 1;
+                    break;
+                }
+                q->data.mouse_report.dx = clamp16(q->data.mouse_report.dx + msg->data.mouse_report.dx);
+                q->data.mouse_report.dy = clamp16(q->data.mouse_report.dy + msg->data.mouse_report.dy);
+                q->data.mouse_report.vertical =
+                    clamp8(q->data.mouse_report.vertical + msg->data.mouse_report.vertical);
+                q->data.mouse_report.horizontal =
+                    clamp8(q->data.mouse_report.horizontal + msg->data.mouse_report.horizontal);
+                stat_merged++;
+                return;
+            case MSG_MOUSE_BUTTON:
+                /* Only a repeat of the state already queued is harmless */
+                if (q->type != MSG_MOUSE_BUTTON ||
+                    q->data.mouse_button.button != msg->data.mouse_button.button) {
+                    continue;
+                }
+                if (q->data.mouse_button.state == msg->data.mouse_button.state) {
+                    stat_merged++;
+                    return;
+                }
+                break;
+            default:
+                if (q->type != msg->type) continue;
+                *e = *entry;
+                stat_merged++;
+                return;
+        }
+        break;
+    }
+    stat_dropped++;
+    if (msg->type == MSG_MOUSE_REPORT) {
+        motion.dx      += msg->data.mouse_report.dx;
+        motion.dy      += msg->data.mouse_report.dy;
+        motion.wheel_v += msg->data.mouse_report.vertical;
+        motion.wheel_h += msg->data.mouse_report.horizontal;
+        if (motion.dx != 0 || motion.dy != 0 || motion.wheel_v != 0 || motion.wheel_h != 0) {
+            if (!motion.pending) {
+                motion.cls        = entry->cls;
+                motion.origin_us  = entry->origin_us;
+                motion.enqueue_us = entry->enqueue_us;
+            }
+            motion.pending = 1;
+            return;
+        }
+    }
+    if (button_change) stat_lost_buttons++;
+}
+
+static void urgent_push(const LaneEntry *entry) {
+    if (urgent_count == URGENT_LANE_LEN) {
+        urgent_merge(entry);
+        return;
+    }
+    urgent[(urgent_head + urgent_count) % URGENT_LANE_LEN] = *entry;
+    urgent_count++;
+}
+
+/* Separate button messages cannot carry motion the way a report does:
+ * move what is pending into the urgent lane ahead of the button, so the
+ * click still lands where the pointer was. With the lane full the motion
+ * stays in the record, which still commits after the button. */
+static void motion_to_urgent(void) {
+    while (motion.pending && urgent_count < URGENT_LANE_LEN) {
+        LaneEntry entry = { .cls = motion.cls, .origin_us = motion.origin_us,
+                            .enqueue_us = motion.enqueue_us };
+        motion_message(&entry.msg);
+        motion_consumed(&entry.msg);
+        motion.cls        = -1;
+        motion.enqueue_us = 0;
+        urgent_push(&entry);
+    }
+}
+
+static void queue_message(const Message *msg) {
+    stat_messages++;
+
+    int is_motion = msg->type == MSG_MOUSE_MOVE || msg->type == MSG_MOUSE_WHEEL ||
+                    (msg->type == MSG_MOUSE_REPORT &&
+                     msg->data.mouse_report.buttons == lane_buttons);
+    if (is_motion) {
+        if (motion.pending) {
+            stat_merged++;
+        } else {
+            motion.cls        = (int8_t)origin_cls;
+            motion.origin_us  = origin_us;
+            motion.enqueue_us = origin_enqueue_us;
+        }
+        switch (msg->type) {
+            case MSG_MOUSE_MOVE:
+                motion.dx += msg->data.mouse_move.dx;
+                motion.dy += msg->data.mouse_move.dy;
+                break;
+            case MSG_MOUSE_WHEEL:
+                motion.wheel_v += msg->data.mouse_wheel.vertical;
+                motion.wheel_h += msg->data.mouse_wheel.horizontal;
+                break;
+            default:
+                motion.dx      += msg->data.mouse_report.dx;
+                motion.dy      += msg->data.mouse_report.dy;
+                motion.wheel_v += msg->data.mouse_report.vertical;
+                motion.wheel_h += msg->data.mouse_report.horizontal;
+                break;
+        }
+        motion.pending = (motion.dx != 0 || motion.dy != 0 ||
+                          motion.wheel_v != 0 || motion.wheel_h != 0);
+        return;
+    }
+
+    LaneEntry entry = { .msg = *msg, .cls = (int8_t)origin_cls, .origin_us = origin_us,
+                        .enqueue_us = origin_enqueue_us };
+    if (msg->type == MSG_MOUSE_REPORT) {
+        /* A button change carries the motion that came before it, so the
+         * click lands where the pointer was, without an extra message */
+        if (motion.pending) {
+            Message pending;
+            msg_mouse_report(&pending, msg->data.mouse_report.buttons,
+                             clamp16(motion.dx + msg->data.mouse_report.dx),
+                             clamp16(motion.dy + msg->data.mouse_report.dy),
+                             clamp8(motion.wheel_v + msg->data.mouse_report.vertical),
+                             clamp8(motion.wheel_h + msg->data.mouse_report.horizontal));
+            motion.dx      += msg->data.mouse_report.dx - pending.data.mouse_report.dx;
+            motion.dy      += msg->data.mouse_report.dy - pending.data.mouse_report.dy;
+            motion.wheel_v += msg->data.mouse_report.vertical - pending.data.mouse_report.vertical;
+            motion.wheel_h += msg->data.mouse_report.horizontal -
+                              pending.data.mouse_report.horizontal;
+            motion.pending = (motion.dx != 0 || motion.dy != 0 ||
+                              motion.wheel_v != 0 || motion.wheel_h != 0);
+            entry.msg = pending;
+        }
+        lane_buttons = msg->data.mouse_report.buttons;
+    } else if (msg->type == MSG_MOUSE_BUTTON) {
+        motion_to_urgent();
+    }
+
+    urgent_push(&entry);
+}
+
+void uart_set_origin(int cls, uint64_t dispatch_us) {
+    origin_cls = cls;
+    origin_us  = dispatch_us;
+}
+
+void uart_set_enqueued(uint64_t enqueue_us) {
+    origin_enqueue_us = enqueue_us;
+}
+
+void uart_set_written_hook(void (*hook)(uint64_t enqueue_us, uint64_t written_us)) {
+    written_hook = hook;
+}
+
+/* Firmware without MSG_MOUSE_REPORT gets the equivalent button changes
+ * followed by separate motion and wheel messages. Each button change
+ * first pushes the motion queued before it out (see motion_to_urgent()). */
+static void send_split_report(const Message *msg) {
+    Message part;
+    uint8_t buttons = msg->data.mouse_report.buttons;
+
+    for (int i = 0; i < 3; i++) {
+        uint8_t bit = (uint8_t)(1 << i);
+        if ((buttons ^ split_buttons) & bit) {
+            msg_mouse_button(&part, (uint8_t)(i + 1),
+                             (buttons & bit) ? BUTTON_PRESSED : BUTTON_RELEASED);
+            queue_message(&part);
+        }
+    }
+    split_buttons = buttons;
+
+    if (msg->data.mouse_report.dx != 0 || msg->data.mouse_report.dy != 0) {
+        msg_mouse_move(&part, msg->data.mouse_report.dx, msg->data.mouse_report.dy);
+        queue_message(&part);
+    }
+    if (msg->data.mouse_report.vertical != 0 || msg->data.mouse_report.horizontal != 0) {
+        msg_mouse_wheel(&part, msg->data.mouse_report.vertical, msg->data.mouse_report.horizontal);
+        queue_message(&part);
+    }
+}
+
+/* Firmware without MSG_KEYBOARD_BITMAP gets the 6KRO report. Keys past
+ * the sixth are left out until a slot frees; a change that only touches
+ * them sends nothing. */
+static void send_6kro_report(const Message *msg) {
+    HIDKeyboardReport before = split_keys;
+    if (msg_bitmap_to_report(&msg->data.keyboard_bitmap, &split_keys) > 0) stat_rollover++;
+    if (memcmp(&before, &split_keys, sizeof(before)) == 0) return;
+
+    Message part;
+    msg_keyboard_report(&part, &split_keys);
+    queue_message(&part);
+}
+
+static int is_input(uint8_t type) {
+    return type == MSG_MOUSE_MOVE || type == MSG_MOUSE_BUTTON || type == MSG_KEYBOARD_REPORT ||
+           type == MSG_MOUSE_WHEEL || type == MSG_MOUSE_REPORT || type == MSG_KEYBOARD_BITMAP;
+}
+
+/* The probe itself is committed once both lanes are empty, so it
+ * measures the path rather than a backlog */
+static void send_probe(void) {
+    unsigned long long now = now_ns();
+    if (probe_due || now - probe_last_ns < LATENCY_PROBE_MS * 1000000ull) return;
+    probe_due     = 1;
+    probe_last_ns = now;
+}
+
+static void probe_echo(const Message *msg) {
+    uint16_t id = msg->data.probe.id;
+    if (probes[id % LATENCY_SLOTS].id != id || probes[id % LATENCY_SLOTS].sent_ns == 0) return;
+
+    unsigned long long total_us = (now_ns() - probes[id % LATENCY_SLOTS].sent_ns) / 1000ull;
+    unsigned long long usb_us   = msg->data.probe.device_us;
+    probes[id % LATENCY_SLOTS].sent_ns = 0;
+
+    hist_add(&hist_total, total_us);
+    hist_add(&hist_usb, usb_us);
+    hist_add(&hist_uart, total_us > usb_us ? total_us - usb_us : 0);
+}
+
 void uart_send(const Message *msg) {
     if (uart_fd < 0 || !msg) return;
-    if (write(uart_fd, msg, sizeof(Message)) != (ssize_t)sizeof(Message)) {
-        fprintf(stderr, "[UART] Write error: %s\n", strerror(errno));
+
+    if (msg->type == MSG_MOUSE_REPORT && !(peer.features & MSG_FEAT_MOUSE_REPORT)) {
+        send_split_report(msg);
+    } else if (msg->type == MSG_KEYBOARD_BITMAP && !(peer.features & MSG_FEAT_NKRO)) {
+        send_6kro_report(msg);
+    } else {
+        if (msg->type == MSG_KEYBOARD_REPORT) split_keys = msg->data.keyboard;
+        queue_message(msg);
+    }
+
+    if ((peer.features & MSG_FEAT_LATENCY_PROBE) && is_input(msg->type)) {
+        send_probe();
+    }
+}
+
+void uart_receive(void) {
+    uint8_t buf[256];
+    Message msg;
+    ssize_t n;
+
+    /* Besides probe echoes this is mostly console log; reading it keeps
+     * the tty buffer from filling (and, with RTS/CTS, from stalling the
+     * firmware's transmitter). */
+    while ((n = read(uart_fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (msg_parser_feed(&rx_parser, buf[i], &msg) && msg.type == MSG_LATENCY_PROBE) {
+                probe_echo(&msg);
+            }
+        }
+    }
+}
+
+void uart_print_stats(void) {
+    printf("[UART] %llu messages in %llu write() calls", stat_messages, stat_writes);
+    if (stat_messages > 0) {
+        double per_k = 1000.0 / (double)stat_messages;
+        unsigned long long saved = stat_messages > stat_writes ? stat_messages - stat_writes : 0;
+        printf(" — per 1000 messages: %.0f syscalls (%.0f saved), %.1f us in write()",
+               (double)stat_writes * per_k, (double)saved * per_k,
+               (double)stat_write_ns * per_k / 1000.0);
+    }
+    printf("; %llu merged, %llu sent ahead of motion, %llu dropped, %zu bytes queued, "
+           "%llu TIOCOUTQ reads\n", stat_merged, stat_overtook, stat_dropped, tx_count, stat_outq);
+    if (peer.legacy) {
+        printf("[UART] Link: version-1 firmware at %d baud\n", peer.baud);
+    } else {
+        printf("[UART] Link: protocol v%u at %d baud, features 0x%04x; "
+               "received %lu frames, %lu non-frame chunks (console log)\n",
+               peer.version, peer.baud, peer.features,
+               (unsigned long)rx_parser.frames_ok, (unsigned long)rx_parser.frames_bad);
+    }
+    if (stat_marks_lost > 0) {
+        printf("[UART] %llu messages not timed: more than %d awaiting write()\n",
+               stat_marks_lost, WRITE_MARKS);
+    }
+    if (stat_lost_buttons > 0) {
+        printf("[UART] %llu button presses/releases dropped on a full send lane\n",
+               stat_lost_buttons);
+    }
+    if (stat_rollover > 0) {
+        printf("[UART] %llu keyboard states held more than 6 keys; firmware without NKRO "
+               "got the first 6\n", stat_rollover);
+    }
+    if (peer.features & MSG_FEAT_LATENCY_PROBE) {
+        printf("[UART] Latency (us), uart = round trip minus firmware time:\n");
+        hist_print("uart", &hist_uart);
+        hist_print("usb", &hist_usb);
+        hist_print("total", &hist_total);
     }
 }
 
 void uart_cleanup(void) {
     if (uart_fd >= 0) {
+        /* Give queued frames (e.g. the final release/switch) a chance to go
+         * out; no pacing now, everything left goes to the tty */
+        struct pollfd pfd = { .fd = uart_fd, .events = POLLOUT };
+        commit_all = 1;
+        uart_flush();
+        while (uart_tx_pending() && poll(&pfd, 1, UART_DRAIN_MS) > 0 &&
+               (pfd.revents & POLLOUT)) {
+            uart_flush();
+        }
+        commit_all = 0;
+
+        /* Leave the firmware at its boot rate for the next session */
+        if (!peer.legacy && peer.baud != peer.initial_baud) {
+            Message msg, reply;
+            msg_set_baud(&msg, (uint32_t)peer.initial_baud);
+            if (send_control(&msg) == 0) {
+                wait_for(MSG_SET_BAUD, HELLO_TIMEOUT_MS, &reply);
+            }
+        }
         close(uart_fd);
         uart_fd = -1;
     }
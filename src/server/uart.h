@@ -1,10 +1,75 @@
 #ifndef UART_H
 #define UART_H
 
+#include <stddef.h>
+#include <sys/uio.h>
 #include "common/protocol.h"
 
-int  uart_init(const char *port, int baud_rate);
+/* Rates the firmware accepts (shared through protocol.h) */
+#define UART_BAUD_MIN MSG_BAUD_MIN
+#define UART_BAUD_MAX MSG_BAUD_MAX
+
+/* Open the port non-blocking at any rate the USB-serial bridge accepts
+ * (termios2/BOTHER), optionally with RTS/CTS flow control, and handshake
+ * with the firmware (MSG_HELLO / MSG_HELLO_ACK). If both sides support it
+ * the link is then moved up to max_baud (0 = stay at baud_rate). Firmware
+ * that does not answer is driven with the version-1 fixed 9-byte messages.
+ * Writes never stall the caller. */
+int  uart_init(const char *port, int baud_rate, int flow_control, int max_baud);
+
+/* The UART fd, for registering EPOLLOUT while uart_tx_pending(). */
+int  uart_get_fd(void);
+
+/* Queue a message. Keyboard reports, button changes and mode switches go
+ * to an urgent lane that is always sent first; motion and wheel deltas
+ * are merged into a single pending record. Nothing reaches the wire
+ * until uart_flush() — uart_send() never blocks. Input messages are
+ * followed by a latency probe at most every 100 ms. */
 void uart_send(const Message *msg);
+
+/* Messages sent until the next call are attributed to an input event of
+ * class cls (LatencyClass) dispatched at dispatch_us; their
+ * dispatch-to-write latency is recorded when write() completes.
+ * cls = -1 stops attributing. */
+void uart_set_origin(int cls, uint64_t dispatch_us);
+
+/* Messages sent until the next call were enqueued for the transport
+ * thread at enqueue_us (0 = not stamped). Once write() has taken a
+ * message's last byte, the hook gets its stamp and the completion time —
+ * enqueue-to-write latency per message, merged messages timed from the
+ * oldest. */
+void uart_set_enqueued(uint64_t enqueue_us);
+void uart_set_written_hook(void (*hook)(uint64_t enqueue_us, uint64_t written_us));
+
+/* Commit queued messages, urgent lane first, while no more than ~2 ms of
+ * wire time is ahead of them in the tty (TIOCOUTQ), and move them into
+ * the tty with a single writev() (two iovecs when the ring wraps). Call
+ * once per event-loop iteration, whenever the fd reports EPOLLOUT, and
+ * when uart_retry_ms() has elapsed. */
+void uart_flush(void);
+
+/* Read what the firmware sent: latency-probe echoes are recorded, the
+ * console log is discarded. Call when the fd reports EPOLLIN. */
+void uart_receive(void);
+
+/* For loops that submit the write themselves (io_uring backend): commit
+ * what the lanes allow and describe the committed bytes in iov. Returns
+ * the iovec count, 0 if nothing is committed. The bytes stay in place
+ * until uart_tx_advance() reports how many were written. */
+int  uart_tx_peek(struct iovec iov[2]);
+void uart_tx_advance(size_t written);
+
+/* Non-zero while committed bytes wait for the tty (watch EPOLLOUT). */
+int  uart_tx_pending(void);
+
+/* Milliseconds until uart_flush() can commit more of what waits in the
+ * lanes, or -1 if nothing waits. */
+int  uart_retry_ms(void);
+
+/* Print message/syscall counters, write() cost per 1000 messages, the
+ * negotiated link and the latency-probe histograms. */
+void uart_print_stats(void);
+
 void uart_cleanup(void);
 
 #endif // UART_H
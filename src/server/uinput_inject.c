@@ -8,34 +8,58 @@
 #include <linux/uinput.h>
 #include <sys/ioctl.h>
 
+#define PENDING_MAX 256   /* events collected per frame / loop iteration */
+
 static int ufd = -1;
 
-int uinput_inject_init(void) {
+/* Events of the frame being built; written at its SYN_REPORT. In deferred
+ * mode the caller takes them instead, once per loop iteration. */
+static int                deferred = 0;
+static struct input_event pending[PENDING_MAX];
+static size_t             pending_count = 0;
+
+static InputCaps current_caps;
+static InputCaps wanted_caps;       /* union still to be applied by a rebuild */
+static int       rebuild_pending = 0;
+static char      sysname[64];   /* inputN, from UI_GET_SYSNAME */
+
+/* Keys and buttons the desktop sees held through the virtual device */
+static unsigned long held[INPUT_BITS_LONGS(KEY_CNT)];
+
+static unsigned long long stat_events = 0;
+static unsigned long long stat_writes = 0;
+
+static int bit_set(const unsigned long *bits, int code) {
+    return (int)((bits[code / (8 * sizeof(long))] >> (code % (8 * sizeof(long)))) & 1);
+}
+
+/* One UI_SET_*BIT per code the devices actually have */
+static int set_bits(unsigned long request, const unsigned long *bits, int count) {
+    int n = 0;
+    for (int code = 0; code < count; code++) {
+        if (bit_set(bits, code)) {
+            ioctl(ufd, request, code);
+            n++;
+        }
+    }
+    return n;
+}
+
+static int create_device(const InputCaps *caps) {
     ufd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
     if (ufd < 0) {
         perror("[UINPUT] Failed to open /dev/uinput");
         return -1;
     }
 
-    /* Enable event types */
+    /* Mirror the capabilities of the captured devices */
+    ioctl(ufd, UI_SET_EVBIT, EV_SYN);
     ioctl(ufd, UI_SET_EVBIT, EV_KEY);
     ioctl(ufd, UI_SET_EVBIT, EV_REL);
     ioctl(ufd, UI_SET_EVBIT, EV_MSC);
-    ioctl(ufd, UI_SET_EVBIT, EV_SYN);
-
-    /* Enable all key codes (covers full keyboard + mouse buttons) */
-    for (int i = 0; i < KEY_MAX; i++) {
-        ioctl(ufd, UI_SET_KEYBIT, i);
-    }
-
-    /* Enable MSC_SCAN for proper scan code passthrough */
-    ioctl(ufd, UI_SET_MSCBIT, MSC_SCAN);
-
-    /* Enable relative axes for mouse */
-    ioctl(ufd, UI_SET_RELBIT, REL_X);
-    ioctl(ufd, UI_SET_RELBIT, REL_Y);
-    ioctl(ufd, UI_SET_RELBIT, REL_WHEEL);
-    ioctl(ufd, UI_SET_RELBIT, REL_HWHEEL);
+    int keys = set_bits(UI_SET_KEYBIT, caps->key, KEY_CNT);
+    int axes = set_bits(UI_SET_RELBIT, caps->rel, REL_CNT);
+    set_bits(UI_SET_MSCBIT, caps->msc, MSC_CNT);
 
     struct uinput_setup usetup;
     memset(&usetup, 0, sizeof(usetup));
@@ -59,13 +83,94 @@ int uinput_inject_init(void) {
         return -1;
     }
 
-    /* Allow udev time to process the new device so input_capture won't grab it */
-    usleep(200000);
+    /* input_capture recognises the device by this name, not by timing */
+    memset(sysname, 0, sizeof(sysname));
+    if (ioctl(ufd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+        perror("[UINPUT] UI_GET_SYSNAME failed");
+        sysname[0] = '\0';
+    }
+
+    current_caps    = *caps;
+    rebuild_pending = 0;
+    printf("[UINPUT] Virtual input device created (%s: %d keys, %d axes)\n",
+           sysname[0] ? sysname : "?", keys, axes);
+    return 0;
+}
+
+static void destroy_device(void) {
+    if (ufd < 0) return;
+    uinput_inject_flush();
+    memset(held, 0, sizeof(held));   /* the kernel releases them */
+    ioctl(ufd, UI_DEV_DESTROY);
+    close(ufd);
+    ufd = -1;
+}
+
+int uinput_inject_init(const InputCaps *caps) {
+    return create_device(caps);
+}
 
-    printf("[UINPUT] Virtual input device created\n");
+static int held_any(void) {
+    for (size_t i = 0; i < INPUT_BITS_LONGS(KEY_CNT); i++) {
+        if (held[i]) return 1;
+    }
     return 0;
 }
 
+int uinput_inject_update_caps(const InputCaps *caps) {
+    if (ufd < 0) return 0;
+
+    InputCaps merged = rebuild_pending ? wanted_caps : current_caps;
+    int added = 0;
+    for (size_t i = 0; i < INPUT_BITS_LONGS(KEY_CNT); i++) {
+        added |= (caps->key[i] & ~merged.key[i]) != 0;
+        merged.key[i] |= caps->key[i];
+    }
+    for (size_t i = 0; i < INPUT_BITS_LONGS(REL_CNT); i++) {
+        added |= (caps->rel[i] & ~merged.rel[i]) != 0;
+        merged.rel[i] |= caps->rel[i];
+    }
+    for (size_t i = 0; i < INPUT_BITS_LONGS(MSC_CNT); i++) {
+        added |= (caps->msc[i] & ~merged.msc[i]) != 0;
+        merged.msc[i] |= caps->msc[i];
+    }
+    if (!added) return 0;
+
+    wanted_caps     = merged;
+    rebuild_pending = 1;
+    if (held_any()) {
+        fprintf(stderr, "[UINPUT] New device brings more keys/axes, recreating virtual device "
+                        "once nothing is held\n");
+    }
+    return uinput_inject_rebuild_if_idle();
+}
+
+int uinput_inject_rebuild_if_idle(void) {
+    if (!rebuild_pending || ufd < 0) return 0;
+
+    /* Destroying the device releases whatever it holds on the desktop: a
+     * modifier held in LOCAL mode would be dropped mid-chord. Wait until
+     * nothing is held and the last frame has been handed over. */
+    if (held_any() || pending_count > 0) return 0;
+
+    /* Capabilities are fixed once created: rebuild the device */
+    fprintf(stderr, "[UINPUT] New device brings more keys/axes, recreating virtual device\n");
+    InputCaps caps = wanted_caps;
+    destroy_device();
+    return create_device(&caps) == 0 ? 1 : -1;
+}
+
+const char *uinput_inject_get_sysname(void) {
+    return sysname;
+}
+
+static void write_events(const struct input_event *evs, size_t count) {
+    stat_writes++;
+    if (write(ufd, evs, count * sizeof(evs[0])) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "[UINPUT] Write error: %s\n", strerror(errno));
+    }
+}
+
 void uinput_inject_event(uint16_t type, uint16_t code, int32_t value) {
     if (ufd < 0) return;
 
@@ -74,17 +179,68 @@ void uinput_inject_event(uint16_t type, uint16_t code, int32_t value) {
     ev.type  = type;
     ev.code  = code;
     ev.value = value;
+    stat_events++;
 
-    if (write(ufd, &ev, sizeof(ev)) < 0 && errno != EAGAIN) {
-        fprintf(stderr, "[UINPUT] Write error: %s\n", strerror(errno));
+    if (type == EV_KEY && code < KEY_CNT && value != 2) {
+        unsigned long mask = 1ul << (code % (8 * sizeof(long)));
+        if (value) held[code / (8 * sizeof(long))] |=  mask;
+        else       held[code / (8 * sizeof(long))] &= ~mask;
+    }
+
+    if (pending_count == PENDING_MAX) {
+        write_events(pending, pending_count);
+        pending_count = 0;
+    }
+    pending[pending_count++] = ev;
+
+    /* A complete frame goes out as one write() of the whole array */
+    if (!deferred && type == EV_SYN && code == SYN_REPORT) {
+        uinput_inject_flush();
+    }
+}
+
+void uinput_inject_flush(void) {
+    if (deferred || pending_count == 0) return;
+    write_events(pending, pending_count);
+    pending_count = 0;
+}
+
+void uinput_inject_release_all(void) {
+    int released = 0;
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (bit_set(held, code)) {
+            uinput_inject_event(EV_KEY, (uint16_t)code, 0);
+            released++;
+        }
     }
+    if (released) uinput_inject_event(EV_SYN, SYN_REPORT, 0);
+}
+
+int uinput_inject_get_fd(void) {
+    return ufd;
+}
+
+void uinput_inject_set_deferred(int on) {
+    deferred = on;
+    uinput_inject_flush();
+}
+
+size_t uinput_inject_take(struct input_event *buf, size_t max) {
+    size_t n = pending_count < max ? pending_count : max;
+    memcpy(buf, pending, n * sizeof(buf[0]));
+    memmove(pending, pending + n, (pending_count - n) * sizeof(pending[0]));
+    pending_count -= n;
+    if (n > 0) stat_writes++;
+    return n;
+}
+
+void uinput_inject_print_stats(void) {
+    printf("[UINPUT] %llu events in %llu write() calls\n", stat_events, stat_writes);
 }
 
 void uinput_inject_cleanup(void) {
     if (ufd >= 0) {
-        ioctl(ufd, UI_DEV_DESTROY);
-        close(ufd);
-        ufd = -1;
+        destroy_device();
         printf("[UINPUT] Virtual input device destroyed\n");
     }
 }
@@ -1,15 +1,53 @@
 #ifndef UINPUT_INJECT_H
 #define UINPUT_INJECT_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <linux/input.h>
+#include "input_capture.h"
 
-/* Create a virtual keyboard+mouse via /dev/uinput.
- * Local X11 session receives input through this device. */
-int  uinput_inject_init(void);
+/* Create a virtual keyboard+mouse via /dev/uinput with the given keys,
+ * axes and MSC codes (the captured devices' union). Local X11 session
+ * receives input through this device. */
+int  uinput_inject_init(const InputCaps *caps);
 
-/* Write a single input event to the virtual device. */
+/* A device was added: if caps has codes the virtual device lacks,
+ * recreate it with the union. While keys or buttons are held the rebuild
+ * waits for uinput_inject_rebuild_if_idle(). Returns 1 if recreated (new
+ * sysname), 0 if nothing changed yet, -1 on failure. */
+int  uinput_inject_update_caps(const InputCaps *caps);
+
+/* Apply a rebuild deferred by uinput_inject_update_caps() once nothing is
+ * held (call once per loop iteration, after the flush). Same returns. */
+int  uinput_inject_rebuild_if_idle(void);
+
+/* sysfs name (inputN) of the virtual device, "" if unknown */
+const char *uinput_inject_get_sysname(void);
+
+/* Queue one input event for the virtual device. Events are buffered
+ * until the frame's SYN_REPORT, then written with a single write(). */
 void uinput_inject_event(uint16_t type, uint16_t code, int32_t value);
 
+/* Write a partial frame still buffered (call once per loop iteration). */
+void uinput_inject_flush(void);
+
+/* Release every key/button held through the virtual device, as one frame. */
+void uinput_inject_release_all(void);
+
+int  uinput_inject_get_fd(void);
+
+/* Deferred mode (io_uring backend): uinput_inject_event() only collects
+ * events, and the loop submits them with uinput_inject_take(). Turning
+ * it off writes whatever is still collected. */
+void uinput_inject_set_deferred(int on);
+
+/* Move up to max collected events into buf, counted as one write.
+ * Returns the number moved. */
+size_t uinput_inject_take(struct input_event *buf, size_t max);
+
+/* Events injected and write() calls (or submitted writes) used. */
+void uinput_inject_print_stats(void);
+
 void uinput_inject_cleanup(void);
 
 #endif // UINPUT_INJECT_H
@@ -0,0 +1,378 @@
+#include "uring_loop.h"
+#include <stdio.h>
+
+#ifdef HAVE_LIBURING
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <liburing.h>
+#include "uart.h"
+#include "uinput_inject.h"
+
+#define RING_ENTRIES   256
+#define BUF_GROUP        1
+#define BUF_COUNT       64    /* provided buffers; power of two */
+#define BUF_EVENTS      64    /* input_events per buffer        */
+#define UINPUT_BATCH   256
+#define GEN_FDS       1024    /* input fds are below this (input_capture refuses higher) */
+
+enum {
+    OP_INPUT_READ = 1,   /* multishot read on an evdev fd        */
+    OP_INPUT_POLL,       /* fallback: multishot poll, then read() */
+    OP_POLL,             /* multishot poll on any other fd        */
+    OP_UINPUT_WRITE,
+    OP_UART_POLL,        /* POLLOUT, linked ahead of the write    */
+    OP_UART_WRITE,
+};
+
+/* user_data: op in the top byte, the fd's watch generation in the next
+ * 24 bits, the fd below. Unwatching an fd bumps its generation, so
+ * completions still in flight for a closed device are told apart from
+ * those of a new device that got the same fd number. */
+#define USER_DATA(op, fd) \
+    (((uint64_t)(op) << 56) | ((uint64_t)gen_of(fd) << 32) | (uint32_t)(fd))
+#define DATA_OP(data)     ((int)((data) >> 56))
+#define DATA_GEN(data)    ((uint32_t)((data) >> 32) & 0xFFFFFF)
+#define DATA_FD(data)     ((int)(uint32_t)(data))
+
+static uint32_t fd_gen[GEN_FDS];
+
+static uint32_t gen_of(int fd) {
+    return (fd >= 0 && fd < GEN_FDS) ? fd_gen[fd] & 0xFFFFFF : 0;
+}
+
+static struct io_uring ring;
+static int ring_ready = 0;
+
+static struct io_uring_buf_ring *buf_ring = NULL;
+static struct input_event (*buffers)[BUF_EVENTS] = NULL;
+static int multishot_read = 1;   /* cleared if the kernel rejects it */
+
+/* Converted events of one completion, handed to on_input() */
+static InputEvent frame[BUF_EVENTS + INPUT_RESYNC_RESERVE];
+
+/* Writes in flight: their memory must stay put until they complete */
+static struct input_event uinput_buf[UINPUT_BATCH];
+static int                uinput_inflight = 0;
+static struct iovec       uart_iov[2];
+static int                uart_inflight = 0;
+
+static unsigned long long stat_enters      = 0;
+static unsigned long long stat_completions = 0;
+static unsigned long long stat_input_cqes  = 0;
+static unsigned long long stat_events      = 0;
+static unsigned long long stat_reads       = 0;   /* fallback read() calls */
+static unsigned long long stat_stale       = 0;   /* completions for an unwatched fd */
+
+static struct io_uring_sqe *get_sqe(void) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+        /* SQ full: push what is queued and try again */
+        io_uring_submit(&ring);
+        stat_enters++;
+        sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+}
+
+static void arm_input(int fd) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    if (multishot_read) {
+        io_uring_prep_read_multishot(sqe, fd, 0, 0, BUF_GROUP);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        io_uring_sqe_set_data64(sqe, USER_DATA(OP_INPUT_READ, fd));
+    } else {
+        io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+        io_uring_sqe_set_data64(sqe, USER_DATA(OP_INPUT_POLL, fd));
+    }
+}
+
+static void arm_poll(int fd) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+    io_uring_sqe_set_data64(sqe, USER_DATA(OP_POLL, fd));
+}
+
+static void recycle_buffer(unsigned bid) {
+    io_uring_buf_ring_add(buf_ring, buffers[bid], sizeof(buffers[bid]), (unsigned short)bid,
+                          io_uring_buf_ring_mask(BUF_COUNT), 0);
+    io_uring_buf_ring_advance(buf_ring, 1);
+}
+
+int uring_loop_init(void) {
+    int ret = io_uring_queue_init(RING_ENTRIES, &ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "[URING] io_uring_queue_init: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    buffers = calloc(BUF_COUNT, sizeof(*buffers));
+    if (buffers) {
+        buf_ring = io_uring_setup_buf_ring(&ring, BUF_COUNT, BUF_GROUP, 0, &ret);
+    }
+    if (!buf_ring) {
+        fprintf(stderr, "[URING] No provided buffers, using poll + read()\n");
+        multishot_read = 0;
+    } else {
+        for (unsigned i = 0; i < BUF_COUNT; i++) {
+            io_uring_buf_ring_add(buf_ring, buffers[i], sizeof(buffers[i]), (unsigned short)i,
+                                  io_uring_buf_ring_mask(BUF_COUNT), (int)i);
+        }
+        io_uring_buf_ring_advance(buf_ring, BUF_COUNT);
+    }
+
+    uinput_inject_set_deferred(1);
+    ring_ready = 1;
+    printf("[URING] io_uring event loop ready\n");
+    return 0;
+}
+
+void uring_loop_watch_input(int fd) {
+    if (ring_ready && fd >= 0) arm_input(fd);
+}
+
+void uring_loop_watch(int fd) {
+    if (ring_ready && fd >= 0) arm_poll(fd);
+}
+
+void uring_loop_unwatch_input(int fd) {
+    if (!ring_ready || fd < 0) return;
+
+    /* Either kind may be posted: the poll fallback can start mid-run */
+    static const int ops[] = { OP_INPUT_READ, OP_INPUT_POLL };
+    for (unsigned i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        struct io_uring_sqe *sqe = get_sqe();
+        if (!sqe) break;
+        io_uring_prep_cancel64(sqe, USER_DATA(ops[i], fd), IORING_ASYNC_CANCEL_ALL);
+        io_uring_sqe_set_data64(sqe, 0);
+    }
+    if (fd < GEN_FDS) fd_gen[fd]++;
+
+    /* Into the kernel now, while fd still names this device */
+    io_uring_submit(&ring);
+    stat_enters++;
+}
+
+/* A completion for an earlier watch of fd: hand back its buffer, drop it */
+static int stale_input(uint64_t data, const struct io_uring_cqe *cqe) {
+    if (DATA_GEN(data) == gen_of(DATA_FD(data))) return 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    stat_stale++;
+    return 1;
+}
+
+static void handle_input_read(int fd, const struct io_uring_cqe *cqe,
+                              const UringHandlers *h) {
+    int res = cqe->res;
+
+    if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        int count = res / (int)sizeof(struct input_event);
+        int n = input_capture_convert(fd, buffers[bid], count, frame,
+                                      (int)(sizeof(frame) / sizeof(frame[0])));
+        recycle_buffer(bid);
+        stat_input_cqes++;
+        stat_events += (unsigned long long)n;
+        if (n > 0) h->on_input(frame, n);
+    } else if (res == -ENODEV) {
+        input_capture_device_gone(fd);
+        return;
+    } else if (res == -EINVAL && multishot_read) {
+        fprintf(stderr, "[URING] Kernel lacks multishot read, using poll + read()\n");
+        multishot_read = 0;
+        arm_input(fd);
+        return;
+    } else if (res < 0 && res != -ENOBUFS && res != -EAGAIN && res != -EINTR) {
+        fprintf(stderr, "[URING] evdev read fd=%d: %s\n", fd, strerror(-res));
+        return;
+    }
+
+    /* Multishot ended (e.g. buffers ran out): post it again */
+    if (!(cqe->flags & IORING_CQE_F_MORE)) arm_input(fd);
+}
+
+static void handle_input_poll(int fd, const struct io_uring_cqe *cqe,
+                              const UringHandlers *h) {
+    int res = cqe->res;
+    if (res < 0) return;
+
+    if (res & POLLIN) {
+        int n = input_capture_read_fd(fd, frame, (int)(sizeof(frame) / sizeof(frame[0])));
+        stat_reads++;
+        stat_input_cqes++;
+        if (n > 0) {
+            stat_events += (unsigned long long)n;
+            h->on_input(frame, n);
+        }
+    }
+    if (res & (POLLERR | POLLHUP)) {
+        /* Device gone; stop the poll that still holds a file reference */
+        struct io_uring_sqe *sqe = get_sqe();
+        if (sqe) {
+            io_uring_prep_cancel64(sqe, USER_DATA(OP_INPUT_POLL, fd), 0);
+            io_uring_sqe_set_data64(sqe, 0);
+        }
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) arm_input(fd);
+}
+
+static void handle_cqe(const struct io_uring_cqe *cqe, const UringHandlers *h) {
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    int op = DATA_OP(data);
+    int fd = DATA_FD(data);
+    int res = cqe->res;
+
+    switch (op) {
+        case OP_INPUT_READ:
+            if (!stale_input(data, cqe)) handle_input_read(fd, cqe, h);
+            break;
+        case OP_INPUT_POLL:
+            if (!stale_input(data, cqe)) handle_input_poll(fd, cqe, h);
+            break;
+        case OP_POLL:
+            if (res > 0) h->on_ready(fd, (uint32_t)res);
+            if (res < 0) {
+                fprintf(stderr, "[URING] poll fd=%d: %s\n", fd, strerror(-res));
+            } else if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                arm_poll(fd);
+            }
+            break;
+        case OP_UINPUT_WRITE:
+            uinput_inflight = 0;
+            if (res < 0 && res != -EAGAIN) {
+                fprintf(stderr, "[URING] uinput write: %s\n", strerror(-res));
+            }
+            break;
+        case OP_UART_POLL:
+            /* Error/hangup on the UART: same handling as the epoll loop */
+            if (res > 0 && (res & (POLLERR | POLLHUP))) h->on_ready(fd, (uint32_t)res);
+            break;
+        case OP_UART_WRITE:
+            uart_inflight = 0;
+            if (res > 0) {
+                uart_tx_advance((size_t)res);
+            } else if (res < 0 && res != -EAGAIN && res != -ECANCELED) {
+                fprintf(stderr, "[URING] UART write: %s\n", strerror(-res));
+            }
+            break;
+        default:
+            break;   /* cancel requests */
+    }
+}
+
+int uring_loop_run_once(const UringHandlers *handlers) {
+    int ret = io_uring_submit_and_wait(&ring, 1);
+    stat_enters++;
+    if (ret < 0) {
+        if (ret == -EINTR) return 0;
+        fprintf(stderr, "[URING] io_uring_submit_and_wait: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    struct io_uring_cqe *cqe;
+    unsigned head, seen = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+        handle_cqe(cqe, handlers);
+        seen++;
+    }
+    io_uring_cq_advance(&ring, seen);
+    stat_completions += seen;
+    return 0;
+}
+
+void uring_loop_queue_writes(void) {
+    if (!ring_ready) return;
+
+    /* One uinput write at a time keeps injected events in order */
+    if (!uinput_inflight) {
+        size_t n = uinput_inject_take(uinput_buf, UINPUT_BATCH);
+        struct io_uring_sqe *sqe = n ? get_sqe() : NULL;
+        if (sqe) {
+            io_uring_prep_write(sqe, uinput_inject_get_fd(), uinput_buf,
+                                (unsigned)(n * sizeof(uinput_buf[0])), (uint64_t)-1);
+            io_uring_sqe_set_data64(sqe, USER_DATA(OP_UINPUT_WRITE, 0));
+            uinput_inflight = 1;
+        }
+    }
+
+    /* The UART fd is non-blocking: wait for POLLOUT in the kernel, then
+     * write, as one linked pair */
+    if (!uart_inflight) {
+        int iovcnt = uart_tx_peek(uart_iov);
+        if (iovcnt > 0) {
+            int fd = uart_get_fd();
+            struct io_uring_sqe *poll_sqe = get_sqe();
+            if (!poll_sqe) return;
+            io_uring_prep_poll_add(poll_sqe, fd, POLLOUT);
+            io_uring_sqe_set_data64(poll_sqe, USER_DATA(OP_UART_POLL, fd));
+            poll_sqe->flags |= IOSQE_IO_LINK;
+
+            struct io_uring_sqe *sqe = get_sqe();
+            if (!sqe) return;
+            io_uring_prep_writev(sqe, fd, uart_iov, (unsigned)iovcnt, (uint64_t)-1);
+            io_uring_sqe_set_data64(sqe, USER_DATA(OP_UART_WRITE, fd));
+            uart_inflight = 1;
+        }
+    }
+}
+
+void uring_loop_print_stats(void) {
+    printf("[URING] %llu io_uring_enter() calls, %llu completions, %llu evdev completions "
+           "carrying %llu events", stat_enters, stat_completions, stat_input_cqes, stat_events);
+    if (stat_events > 0) {
+        printf(" — per 1000 events: %.0f syscalls",
+               (double)(stat_enters + stat_reads) * 1000.0 / (double)stat_events);
+    }
+    if (stat_stale > 0) printf("; %llu stale completions dropped", stat_stale);
+    printf("; %s\n", multishot_read ? "multishot reads" : "poll + read() fallback");
+}
+
+void uring_loop_cleanup(void) {
+    if (!ring_ready) return;
+
+    /* Let the final writes (release-all, mode switch) complete */
+    static const UringHandlers none = { NULL, NULL };
+    for (int i = 0; i < 50 && (uinput_inflight || uart_inflight); i++) {
+        struct __kernel_timespec ts = { .tv_sec = 0, .tv_nsec = 10000000 };
+        struct io_uring_cqe *cqe;
+        io_uring_submit(&ring);
+        if (io_uring_wait_cqe_timeout(&ring, &cqe, &ts) != 0) continue;
+
+        unsigned head, seen = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            int op = DATA_OP(io_uring_cqe_get_data64(cqe));
+            if (op == OP_UINPUT_WRITE || op == OP_UART_WRITE) handle_cqe(cqe, &none);
+            seen++;
+        }
+        io_uring_cq_advance(&ring, seen);
+    }
+
+    uinput_inject_set_deferred(0);
+    if (buf_ring) io_uring_free_buf_ring(&ring, buf_ring, BUF_COUNT, BUF_GROUP);
+    io_uring_queue_exit(&ring);
+    free(buffers);
+    buf_ring   = NULL;
+    buffers    = NULL;
+    ring_ready = 0;
+}
+
+#else  /* !HAVE_LIBURING */
+
+int uring_loop_init(void) {
+    fprintf(stderr, "[URING] Built without liburing\n");
+    return -1;
+}
+
+void uring_loop_watch_input(int fd)                         { (void)fd; }
+void uring_loop_watch(int fd)                               { (void)fd; }
+void uring_loop_unwatch_input(int fd)                       { (void)fd; }
+int  uring_loop_run_once(const UringHandlers *handlers)     { (void)handlers; return -1; }
+void uring_loop_queue_writes(void)                          {}
+void uring_loop_print_stats(void)                           {}
+void uring_loop_cleanup(void)                               {}
+
+#endif
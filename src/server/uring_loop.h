@@ -0,0 +1,51 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <stdint.h>
+#include "input_capture.h"
+
+/* Alternative event-loop backend on io_uring (built with liburing).
+ *
+ * Every grabbed evdev fd keeps a multishot read posted into a ring of
+ * provided buffers, so input arrives without a read() per wakeup; other
+ * fds (udev monitor, timerfd, UART input) use multishot polls. At the end
+ * of each iteration the uinput events collected by uinput_inject and the
+ * committed UART bytes are submitted as writes — the UART write linked
+ * behind a POLLOUT poll — together with the next wait, in one
+ * io_uring_enter(). Dispatch order is the same as the epoll loop:
+ * completions are handled in arrival order, writes go out once per
+ * iteration. Kernels without multishot reads (< 6.7) fall back to
+ * multishot polls plus read(). */
+
+typedef struct {
+    void (*on_input)(const InputEvent *events, int count);
+    void (*on_ready)(int fd, uint32_t revents);   /* POLLIN/POLLERR/POLLHUP */
+} UringHandlers;
+
+/* Returns 0 on success, -1 if not built with liburing or the kernel
+ * refuses (the caller then uses the epoll loop). */
+int  uring_loop_init(void);
+
+void uring_loop_watch_input(int fd);
+void uring_loop_watch(int fd);
+
+/* Cancel the read or poll posted on an input fd. Must run before the fd
+ * is closed (see input_capture_set_close_hook()): completions that still
+ * arrive for it are dropped, even once the number names another device. */
+void uring_loop_unwatch_input(int fd);
+
+/* Submit pending work and wait for at least one completion (or a signal),
+ * then run the handlers for everything that completed. Returns 0, or -1
+ * on a fatal error. */
+int  uring_loop_run_once(const UringHandlers *handlers);
+
+/* Queue the collected uinput events and committed UART bytes; they go
+ * out with the next uring_loop_run_once(). */
+void uring_loop_queue_writes(void);
+
+void uring_loop_print_stats(void);
+
+/* Wait for writes in flight, then tear down the ring. */
+void uring_loop_cleanup(void);
+
+#endif // URING_LOOP_H
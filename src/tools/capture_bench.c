@@ -0,0 +1,419 @@
+/*
+ * capture_bench — compares the two ways of reading evdev input.
+ *
+ * Creates a uinput mouse and feeds it REL_X/REL_Y/SYN_REPORT frames from a
+ * writer thread at a fixed rate (8 kHz by default, like a high-polling-rate
+ * gaming mouse). The reader drains the resulting /dev/input/eventN node
+ * through epoll, once per mode:
+ *
+ *   libevdev  one libevdev_next_event() call per event until -EAGAIN,
+ *             as the server did before batching
+ *   bulk      one read() of up to 64 input_events per wakeup,
+ *             as input_capture_read_fd() does now
+ *   io_uring  a multishot read into provided buffers, one
+ *             io_uring_enter() per wakeup, as the server's --io-uring
+ *             loop does (only when built with liburing)
+ *
+ * and reports reader CPU time, wakeups and syscalls per 1000 events, plus
+ * p50/p99 latency from the kernel's event timestamp to the reader seeing
+ * the SYN_REPORT. Needs write access to /dev/uinput (usually root).
+ *
+ * Usage: capture-bench [seconds] [rate_hz]   (default 3 s, 8000 Hz)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <libevdev/libevdev.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define DEFAULT_SECONDS 3
+#define DEFAULT_RATE_HZ 8000
+#define READ_BATCH      64
+#define URING_BUFFERS   16   /* provided buffers; power of two */
+
+typedef struct {
+    int         ufd;
+    long        rate_hz;
+    atomic_bool stop;
+} Writer;
+
+typedef struct {
+    const char *name;
+    unsigned long events;
+    unsigned long wakeups;
+    unsigned long syscalls;   /* 0 when not observable (libevdev reads internally) */
+    double cpu_s;
+    uint32_t *lat_us;         /* kernel timestamp -> SYN_REPORT seen, per frame */
+    size_t    lat_count;
+    size_t    lat_cap;
+} Result;
+
+static double clock_s(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Timestamps are switched to CLOCK_MONOTONIC with EVIOCSCLOCKID, so
+ * this compares directly against them */
+static void note_frame(Result *r, const struct input_event *ev) {
+    if (ev->type != EV_SYN || ev->code != SYN_REPORT || r->lat_count == r->lat_cap) return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t now_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    int64_t ev_us  = (int64_t)ev->input_event_sec * 1000000 + ev->input_event_usec;
+    r->lat_us[r->lat_count++] = now_us > ev_us ? (uint32_t)(now_us - ev_us) : 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int create_mouse(char *node, size_t node_len) {
+    int ufd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (ufd < 0) {
+        perror("open /dev/uinput");
+        return -1;
+    }
+
+    ioctl(ufd, UI_SET_EVBIT, EV_KEY);
+    ioctl(ufd, UI_SET_EVBIT, EV_REL);
+    ioctl(ufd, UI_SET_EVBIT, EV_SYN);
+    ioctl(ufd, UI_SET_KEYBIT, BTN_LEFT);
+    ioctl(ufd, UI_SET_RELBIT, REL_X);
+    ioctl(ufd, UI_SET_RELBIT, REL_Y);
+
+    struct uinput_setup usetup;
+    memset(&usetup, 0, sizeof(usetup));
+    usetup.id.bustype = BUS_VIRTUAL;
+    usetup.id.vendor  = 0x1d6b;  /* Linux Foundation */
+    usetup.id.product = 0x0002;
+    usetup.id.version = 1;
+    strncpy(usetup.name, "OneKM Capture Bench", UINPUT_MAX_NAME_SIZE - 1);
+
+    char sysname[64] = {0};
+    if (ioctl(ufd, UI_DEV_SETUP, &usetup) < 0 ||
+        ioctl(ufd, UI_DEV_CREATE) < 0 ||
+        ioctl(ufd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+        perror("uinput setup");
+        close(ufd);
+        return -1;
+    }
+
+    /* /sys/devices/virtual/input/inputN/eventM names the event node */
+    char dir_path[128];
+    snprintf(dir_path, sizeof(dir_path), "/sys/devices/virtual/input/%s", sysname);
+
+    for (int tries = 0; tries < 50; tries++) {
+        DIR *dir = opendir(dir_path);
+        if (dir) {
+            struct dirent *ent;
+            while ((ent = readdir(dir)) != NULL) {
+                if (strncmp(ent->d_name, "event", 5) == 0) {
+                    snprintf(node, node_len, "/dev/input/%s", ent->d_name);
+                    closedir(dir);
+                    /* Give udev a moment to create the node */
+                    for (int i = 0; i < 50 && access(node, R_OK) != 0; i++) usleep(10000);
+                    return ufd;
+                }
+            }
+            closedir(dir);
+        }
+        usleep(10000);
+    }
+
+    fprintf(stderr, "No event node for %s\n", sysname);
+    ioctl(ufd, UI_DEV_DESTROY);
+    close(ufd);
+    return -1;
+}
+
+/* Emits one REL_X/REL_Y/SYN_REPORT frame per period on an absolute
+ * schedule, so the rate holds even if individual wakeups are late. */
+static void *writer_thread(void *arg) {
+    Writer *w = arg;
+    long period_ns = 1000000000L / w->rate_hz;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    struct input_event frame[3];
+    memset(frame, 0, sizeof(frame));
+    frame[0].type = EV_REL; frame[0].code = REL_X;
+    frame[1].type = EV_REL; frame[1].code = REL_Y;
+    frame[2].type = EV_SYN; frame[2].code = SYN_REPORT;
+
+    unsigned i = 0;
+    while (!atomic_load(&w->stop)) {
+        frame[0].value = (i & 1) ? 1 : -1;
+        frame[1].value = (i & 2) ? 1 : -1;
+        i++;
+        if (write(w->ufd, frame, sizeof(frame)) < 0 && errno != EAGAIN) {
+            perror("uinput write");
+            break;
+        }
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+static void drain(int fd, struct libevdev *dev) {
+    struct input_event ev;
+    if (dev) {
+        while (libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL, &ev) >= 0) {}
+    } else {
+        while (read(fd, &ev, sizeof(ev)) > 0) {}
+    }
+}
+
+static int open_node(const char *node) {
+    int fd = open(node, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        perror(node);
+        return -1;
+    }
+    int clk = CLOCK_MONOTONIC;
+    ioctl(fd, EVIOCSCLOCKID, &clk);
+    return fd;
+}
+
+static int run(Result *r, const char *node, int seconds, int use_libevdev) {
+    int fd = open_node(node);
+    if (fd < 0) return -1;
+
+    struct libevdev *dev = NULL;
+    if (use_libevdev && libevdev_new_from_fd(fd, &dev) < 0) {
+        fprintf(stderr, "libevdev_new_from_fd failed\n");
+        close(fd);
+        return -1;
+    }
+
+    int epfd = epoll_create1(0);
+    struct epoll_event eev = { .events = EPOLLIN, .data.fd = fd };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &eev);
+
+    drain(fd, dev);
+
+    struct input_event batch[READ_BATCH];
+    volatile int32_t sink = 0;
+    double end = clock_s(CLOCK_MONOTONIC) + seconds;
+    double cpu0 = clock_s(CLOCK_THREAD_CPUTIME_ID);
+
+    while (clock_s(CLOCK_MONOTONIC) < end) {
+        struct epoll_event ready;
+        int nready = epoll_wait(epfd, &ready, 1, 100);
+        if (!use_libevdev) r->syscalls++;
+        if (nready <= 0) continue;
+        r->wakeups++;
+
+        if (use_libevdev) {
+            struct input_event ev;
+            int rc;
+            while ((rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL, &ev)) >= 0) {
+                if (rc == LIBEVDEV_READ_STATUS_SYNC) continue;
+                sink += ev.value;
+                r->events++;
+                note_frame(r, &ev);
+            }
+        } else {
+            ssize_t n = read(fd, batch, sizeof(batch));
+            r->syscalls++;
+            if (n <= 0) continue;
+            int count = (int)((size_t)n / sizeof(batch[0]));
+            for (int i = 0; i < count; i++) {
+                sink += batch[i].value;
+                note_frame(r, &batch[i]);
+            }
+            r->events += (unsigned long)count;
+        }
+    }
+
+    r->cpu_s = clock_s(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+    (void)sink;
+
+    close(epfd);
+    if (dev) libevdev_free(dev);
+    close(fd);
+    return 0;
+}
+
+#ifdef HAVE_LIBURING
+static int run_uring(Result *r, const char *node, int seconds) {
+    int fd = open_node(node);
+    if (fd < 0) return -1;
+
+    struct io_uring ring;
+    int ret = io_uring_queue_init(8, &ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        close(fd);
+        return -1;
+    }
+
+    static struct input_event bufs[URING_BUFFERS][READ_BATCH];
+    struct io_uring_buf_ring *br = io_uring_setup_buf_ring(&ring, URING_BUFFERS, 0, 0, &ret);
+    if (!br) {
+        fprintf(stderr, "io_uring_setup_buf_ring: %s\n", strerror(-ret));
+        io_uring_queue_exit(&ring);
+        close(fd);
+        return -1;
+    }
+    int mask = io_uring_buf_ring_mask(URING_BUFFERS);
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        io_uring_buf_ring_add(br, bufs[i], sizeof(bufs[i]), (unsigned short)i, mask, i);
+    }
+    io_uring_buf_ring_advance(br, URING_BUFFERS);
+
+    drain(fd, NULL);
+
+    volatile int32_t sink = 0;
+    int armed = 0;
+    double end = clock_s(CLOCK_MONOTONIC) + seconds;
+    double cpu0 = clock_s(CLOCK_THREAD_CPUTIME_ID);
+
+    while (clock_s(CLOCK_MONOTONIC) < end) {
+        if (!armed) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_read_multishot(sqe, fd, 0, 0, 0);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            armed = 1;
+        }
+
+        struct __kernel_timespec ts = { .tv_sec = 0, .tv_nsec = 100000000 };
+        struct io_uring_cqe *cqe;
+        ret = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+        r->syscalls++;
+        if (ret < 0) continue;
+        r->wakeups++;
+
+        unsigned head, seen = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            seen++;
+            if (!(cqe->flags & IORING_CQE_F_MORE)) armed = 0;
+            if (cqe->res == -EINVAL) {
+                fprintf(stderr, "Kernel lacks multishot read (needs 6.7+)\n");
+                end = 0;
+                continue;
+            }
+            if (cqe->res <= 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) continue;
+
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            int count = cqe->res / (int)sizeof(struct input_event);
+            for (int i = 0; i < count; i++) {
+                sink += bufs[bid][i].value;
+                note_frame(r, &bufs[bid][i]);
+            }
+            r->events += (unsigned long)count;
+            io_uring_buf_ring_add(br, bufs[bid], sizeof(bufs[bid]), (unsigned short)bid, mask, 0);
+            io_uring_buf_ring_advance(br, 1);
+        }
+        io_uring_cq_advance(&ring, seen);
+    }
+
+    r->cpu_s = clock_s(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+    (void)sink;
+
+    io_uring_free_buf_ring(&ring, br, URING_BUFFERS, 0);
+    io_uring_queue_exit(&ring);
+    close(fd);
+    return 0;
+}
+#endif
+
+static void report(Result *r) {
+    double k = r->events ? 1000.0 / (double)r->events : 0.0;
+    printf("%-9s %9lu events  %7.1f us cpu/1000  %6.1f wakeups/1000  ",
+           r->name, r->events, r->cpu_s * 1e6 * k, (double)r->wakeups * k);
+    if (r->syscalls) {
+        printf("%6.1f syscalls/1000", (double)r->syscalls * k);
+    } else {
+        printf("  (reads internal)");
+    }
+    if (r->lat_count > 0) {
+        qsort(r->lat_us, r->lat_count, sizeof(r->lat_us[0]), cmp_u32);
+        printf("  latency p50 %u us p99 %u us", r->lat_us[r->lat_count / 2],
+               r->lat_us[(r->lat_count * 99) / 100]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    int  seconds = DEFAULT_SECONDS;
+    long rate_hz = DEFAULT_RATE_HZ;
+    if (argc > 1) seconds = atoi(argv[1]);
+    if (argc > 2) rate_hz = strtol(argv[2], NULL, 0);
+    if (seconds <= 0 || rate_hz <= 0 || rate_hz > 1000000) {
+        fprintf(stderr, "Usage: %s [seconds] [rate_hz]\n", argv[0]);
+        return 1;
+    }
+
+    char node[64];
+    int ufd = create_mouse(node, sizeof(node));
+    if (ufd < 0) return 1;
+
+    printf("Source: %s, %ld frames/s (3 events each), %d s per mode\n\n",
+           node, rate_hz, seconds);
+
+    Writer w = { .ufd = ufd, .rate_hz = rate_hz };
+    atomic_init(&w.stop, false);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, writer_thread, &w) != 0) {
+        perror("pthread_create");
+        ioctl(ufd, UI_DEV_DESTROY);
+        close(ufd);
+        return 1;
+    }
+
+    Result results[] = {
+        { .name = "libevdev" },
+        { .name = "bulk" },
+#ifdef HAVE_LIBURING
+        { .name = "io_uring" },
+#endif
+    };
+    int modes = (int)(sizeof(results) / sizeof(results[0]));
+    size_t frames = (size_t)rate_hz * (size_t)seconds + 1024;
+    int rc = 0;
+    for (int i = 0; i < modes && rc == 0; i++) {
+        results[i].lat_us  = malloc(frames * sizeof(uint32_t));
+        results[i].lat_cap = results[i].lat_us ? frames : 0;
+#ifdef HAVE_LIBURING
+        if (i == 2) {
+            rc = run_uring(&results[i], node, seconds);
+            continue;
+        }
+#endif
+        rc = run(&results[i], node, seconds, i == 0);
+    }
+
+    atomic_store(&w.stop, true);
+    pthread_join(tid, NULL);
+    ioctl(ufd, UI_DEV_DESTROY);
+    close(ufd);
+
+    for (int i = 0; i < modes; i++) {
+        if (rc == 0) report(&results[i]);
+        free(results[i].lat_us);
+    }
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+/*
+ * inject_bench — cost of LOCAL-mode passthrough into uinput.
+ *
+ * Drives the server's uinput_inject module with a synthetic mouse: frames
+ * of REL_X, REL_Y and SYN_REPORT (every 16th frame also a BTN_LEFT
+ * change), generated as fast as possible, once per mode:
+ *
+ *   per-event  one write() per input_event, as the server did before
+ *              frame batching (flushed after every event)
+ *   per-frame  one write() per frame at its SYN_REPORT, as now
+ *
+ * and reports process CPU time (user + kernel) and write() calls per 1000
+ * frames. The virtual device is real: the cursor jitters by a pixel and
+ * a left click is pressed and released, so run it on an idle desktop.
+ * Needs write access to /dev/uinput (usually root).
+ *
+ * Usage: inject-bench [frames]   (default 200000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/input.h>
+#include "server/uinput_inject.h"
+
+#define DEFAULT_FRAMES 200000L
+
+typedef struct {
+    const char   *name;
+    unsigned long events;
+    unsigned long writes;
+    double        cpu_s;
+} Result;
+
+static double cpu_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void inject(Result *r, int per_event, uint16_t type, uint16_t code, int32_t value) {
+    uinput_inject_event(type, code, value);
+    r->events++;
+    if (per_event) {
+        uinput_inject_flush();
+        r->writes++;
+    } else if (type == EV_SYN && code == SYN_REPORT) {
+        r->writes++;
+    }
+}
+
+static void run(Result *r, long frames, int per_event) {
+    double cpu0 = cpu_s();
+    for (long i = 0; i < frames; i++) {
+        inject(r, per_event, EV_REL, REL_X, (i & 1) ? 1 : -1);
+        inject(r, per_event, EV_REL, REL_Y, (i & 2) ? 1 : -1);
+        if ((i & 15) == 0) inject(r, per_event, EV_KEY, BTN_LEFT, (i & 16) ? 0 : 1);
+        inject(r, per_event, EV_SYN, SYN_REPORT, 0);
+    }
+    r->cpu_s = cpu_s() - cpu0;
+}
+
+int main(int argc, char *argv[]) {
+    long frames = DEFAULT_FRAMES;
+    if (argc > 1) frames = strtol(argv[1], NULL, 0);
+    if (frames <= 0) {
+        fprintf(stderr, "Usage: %s [frames]\n", argv[0]);
+        return 1;
+    }
+
+    InputCaps caps;
+    memset(&caps, 0, sizeof(caps));
+    caps.key[BTN_LEFT / (8 * sizeof(long))] |= 1ul << (BTN_LEFT % (8 * sizeof(long)));
+    caps.rel[0] |= (1ul << REL_X) | (1ul << REL_Y);
+    if (uinput_inject_init(&caps) != 0) return 1;
+    printf("%ld frames per mode\n\n", frames);
+
+    Result results[2] = {
+        { .name = "per-event" },
+        { .name = "per-frame" },
+    };
+    for (int i = 0; i < 2; i++) {
+        run(&results[i], frames, i == 0);
+        /* Leave the button released between modes */
+        uinput_inject_event(EV_KEY, BTN_LEFT, 0);
+        uinput_inject_event(EV_SYN, SYN_REPORT, 0);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        const Result *r = &results[i];
+        double k = 1000.0 / (double)frames;
+        printf("%-9s %9lu events  %7.1f us cpu/1000 frames  %7.1f writes/1000 frames\n",
+               r->name, r->events, r->cpu_s * 1e6 * k, (double)r->writes * k);
+    }
+    uinput_inject_print_stats();
+
+    uinput_inject_cleanup();
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * protocol_bench — host-side throughput benchmark for the UART frame parser.
+ *
+ * Encodes a representative mix of messages into one byte stream and feeds
+ * it through msg_parser_feed() byte by byte, exactly as the firmware's
+ * receive task does. Reports decoded messages per second and compares the
+ * result with what the wire can deliver from 115200 baud up to the 5 Mbaud
+ * link limit: the fixed 9-byte v1 message, a 6-byte compact frame (small
+ * mouse motion) and the benchmark's own mix, as quoted in README.md.
+ *
+ * Usage: protocol-bench [messages]   (default 1000000)
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/protocol.h"
+
+#define DEFAULT_MESSAGES 1000000
+#define ROUNDS           5
+#define COMPACT_FRAME    6   /* MSG_MOUSE_MOVE with |delta| < 64 */
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Mostly small mouse motion with occasional buttons, wheel and keys,
+ * roughly what a busy remote session looks like on the wire. */
+static void make_message(Message *msg, unsigned i) {
+    switch (i % 16) {
+        case 0: {
+            HIDKeyboardReport kb = { .modifiers = 0x02, .keys = { 0x04 } };
+            msg_keyboard_report(msg, &kb);
+            break;
+        }
+        case 1:  msg_mouse_report(msg, 0x01, 5, -3, 0, 0); break;
+        case 2:  msg_mouse_report(msg, 0x00, 0, 0, 1, 0); break;
+        case 3:  msg_mouse_report(msg, 0x00, 300, -200, 0, 0); break;
+        default: msg_mouse_report(msg, 0x00, (int16_t)(i % 7) - 3, (int16_t)(i % 5) - 2, 0, 0); break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned count = DEFAULT_MESSAGES;
+    if (argc > 1) {
+        count = (unsigned)strtoul(argv[1], NULL, 0);
+        if (count == 0) {
+            fprintf(stderr, "Usage: %s [messages]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    uint8_t *stream = malloc((size_t)count * MSG_FRAME_MAX);
+    if (!stream) {
+        perror("malloc");
+        return 1;
+    }
+
+    size_t bytes = 0;
+    for (unsigned i = 0; i < count; i++) {
+        Message msg;
+        make_message(&msg, i);
+        bytes += msg_frame_encode(&msg, stream + bytes);
+    }
+
+    double best = 0;
+    unsigned long decoded = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        MsgParser parser;
+        Message msg;
+        unsigned long n = 0;
+
+        msg_parser_init(&parser);
+        double start = now_s();
+        for (size_t i = 0; i < bytes; i++) {
+            n += (unsigned long)msg_parser_feed(&parser, stream[i], &msg);
+        }
+        double elapsed = now_s() - start;
+
+        if (parser.frames_bad != 0) {
+            fprintf(stderr, "Parser rejected %u frames\n", (unsigned)parser.frames_bad);
+            free(stream);
+            return 1;
+        }
+        if (best == 0 || elapsed < best) best = elapsed;
+        decoded = n;
+    }
+
+    double msgs_per_s = (double)decoded / best;
+    double avg_frame  = (double)bytes / (double)count;
+    printf("%lu messages, %zu bytes (%.2f bytes/frame), best of %d rounds\n",
+           decoded, bytes, avg_frame, ROUNDS);
+    printf("parser: %.1f M messages/s, %.1f MB/s, %.1f ns/message\n",
+           msgs_per_s / 1e6, (double)bytes / best / 1e6, best * 1e9 / (double)decoded);
+
+    /* 8N1: 10 bits per byte on the wire */
+    static const int bauds[] = { 115200, 230400, 460800, 921600,
+                                 2000000, 3000000, 4000000, MSG_BAUD_MAX };
+    printf("  %7s  %14s  %14s  %14s  %s\n", "baud", "fixed 9-byte", "compact 6-byte",
+           "this mix", "parser headroom");
+    for (size_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+        double bytes_per_s = (double)bauds[i] / 10.0;
+        double wire = bytes_per_s / avg_frame;
+        printf("  %7d  %8.0f msg/s  %8.0f msg/s  %8.0f msg/s  %.0fx\n", bauds[i],
+               bytes_per_s / MSG_LEGACY_SIZE, bytes_per_s / COMPACT_FRAME, wire,
+               msgs_per_s / wire);
+    }
+
+    free(stream);
+    return 0;
+}
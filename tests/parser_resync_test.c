@@ -0,0 +1,227 @@
+/*
+ * parser_resync_test — feeds msg_parser_feed() a stream of frames with
+ * one fault injected per trial: a byte dropped (delimiters included, so
+ * two frames run together), a stray byte inserted, a bit flipped, or the
+ * stream joined part-way into its first frame.
+ *
+ * Each decoded message is traced back to the delimiter that completed
+ * it. Every frame the fault did not touch must come out exactly once, in
+ * order and unchanged — i.e. the parser is back in step at the first
+ * delimiter after the damage. The damaged frame must be rejected; CRC-8
+ * lets about 1 in 256 corrupted frames through, so up to 1% escapes per
+ * kind of fault are tolerated and reported. (Two frames merged by a lost
+ * delimiter used to pass the CRC every time; see msg_crc8().)
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "common/protocol.h"
+
+#define STREAM_MSGS   48
+#define STREAM_MAX    (STREAM_MSGS * MSG_FRAME_MAX)
+#define TRIALS        4000
+#define ESCAPES_MAX   (TRIALS / FAULT_KINDS / 100)   /* per fault kind */
+
+enum { FAULT_DROP, FAULT_INSERT, FAULT_FLIP, FAULT_JOIN, FAULT_KINDS };
+
+static const char *const fault_names[FAULT_KINDS] = { "drop", "insert", "flip", "join" };
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        if (!(cond)) {                                          \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);         \
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+typedef struct {
+    Message msgs[STREAM_MSGS];
+    uint8_t bytes[STREAM_MAX];
+    size_t  len;
+    int     frame_of[STREAM_MAX];   /* byte -> index of the frame it belongs to */
+} Stream;
+
+typedef struct {
+    uint8_t bytes[STREAM_MAX + 1];
+    int     origin[STREAM_MAX + 1]; /* byte -> position in the clean stream, -1 if inserted */
+    size_t  len;
+} Faulty;
+
+static uint32_t rng_state = 0x1234567u;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static int16_t rng_delta(void) {
+    /* Mostly small deltas, like real motion, with the odd long one */
+    return (int16_t)((rng() & 7) ? (int)(rng() % 127) - 63 : (int)(rng() % 4001) - 2000);
+}
+
+static void random_message(Message *msg) {
+    memset(msg, 0, sizeof(*msg));
+    switch (rng() % 6) {
+        case 0:
+            msg_mouse_move(msg, rng_delta(), rng_delta());
+            break;
+        case 1:
+            msg_mouse_button(msg, (uint8_t)(1u << (rng() % 3)), (uint8_t)(rng() & 1));
+            break;
+        case 2: {
+            HIDKeyboardReport report = { .modifiers = (uint8_t)rng() };
+            for (int i = 0; i < (int)(rng() % 7); i++) report.keys[i] = (uint8_t)(4 + rng() % 96);
+            msg_keyboard_report(msg, &report);
+            break;
+        }
+        case 3: {
+            HIDKeyboardBitmap bitmap = { .modifiers = (uint8_t)rng() };
+            bitmap.keys[rng() % MSG_KEY_BITMAP_BYTES] = (uint8_t)rng();
+            msg_keyboard_bitmap(msg, &bitmap);
+            break;
+        }
+        case 4:
+            msg_mouse_wheel(msg, (int16_t)((int)(rng() % 7) - 3), 0);
+            break;
+        default:
+            msg_mouse_report(msg, (uint8_t)(rng() & 7), rng_delta(), rng_delta(),
+                             (int16_t)((int)(rng() % 3) - 1), 0);
+            break;
+    }
+}
+
+static void build_stream(Stream *s) {
+    s->len = 0;
+    for (int i = 0; i < STREAM_MSGS; i++) {
+        random_message(&s->msgs[i]);
+        size_t n = msg_frame_encode(&s->msgs[i], s->bytes + s->len);
+        for (size_t j = 0; j < n; j++) s->frame_of[s->len + j] = i;
+        s->len += n;
+    }
+}
+
+/* Copy s into f with one fault at position pos of the clean stream */
+static void inject(const Stream *s, int kind, size_t pos, Faulty *f) {
+    f->len = 0;
+    for (size_t i = 0; i < s->len; i++) {
+        if (kind == FAULT_JOIN && i < pos) continue;
+        if (kind == FAULT_DROP && i == pos) continue;
+        if (kind == FAULT_INSERT && i == pos) {
+            f->origin[f->len]  = -1;
+            f->bytes[f->len++] = (uint8_t)rng();
+        }
+        uint8_t byte = s->bytes[i];
+        if (kind == FAULT_FLIP && i == pos) byte ^= (uint8_t)(1u << (rng() % 8));
+        f->origin[f->len]  = (int)i;
+        f->bytes[f->len++] = byte;
+    }
+}
+
+/* Returns 1 if the damaged frame(s) let a wrong message through */
+static int run_trial(const Stream *s, int kind, int trial) {
+    size_t pos;
+    do {
+        pos = rng() % s->len;
+        /* A flipped delimiter is a dropped one plus a stray byte. The
+         * join must start inside frame 0, before its delimiter, and the
+         * drop must leave a delimiter after it: otherwise the frame is
+         * merely cut off, which no parser can notice. */
+    } while ((kind == FAULT_FLIP && s->bytes[pos] == MSG_FRAME_DELIM) ||
+             (kind == FAULT_JOIN && (pos == 0 || s->frame_of[pos] != 0 ||
+                                     s->bytes[pos] == MSG_FRAME_DELIM)) ||
+             (kind == FAULT_DROP && pos == s->len - 1));
+
+    Faulty f;
+    inject(s, kind, pos, &f);
+
+    /* The frame holding the fault is damaged; dropping its delimiter
+     * merges it with the next one */
+    int first_bad = s->frame_of[pos];
+    int last_bad  = first_bad;
+    if (kind == FAULT_DROP && s->bytes[pos] == MSG_FRAME_DELIM && last_bad + 1 < STREAM_MSGS) {
+        last_bad++;
+    }
+
+    MsgParser parser;
+    msg_parser_init(&parser);
+    int next = 0;          /* next undamaged frame expected */
+    int escaped = 0;
+    int intact  = 0;       /* damaged range decoded as sent anyway (e.g. an inserted idle 0x00) */
+    Message decoded;
+    for (size_t i = 0; i < f.len; i++) {
+        if (!msg_parser_feed(&parser, f.bytes[i], &decoded)) continue;
+
+        int frame = f.origin[i] < 0 ? -1 : s->frame_of[f.origin[i]];
+        if (frame < 0 || (frame >= first_bad && frame <= last_bad)) {
+            /* Completed by a stray delimiter or inside the damage: fine
+             * only if it is what was sent there */
+            if (frame < 0 || memcmp(&decoded, &s->msgs[frame], sizeof(Message)) != 0) {
+                escaped = 1;
+            } else {
+                intact++;
+            }
+            continue;
+        }
+
+        while (next >= first_bad && next <= last_bad) next++;
+        CHECK(frame == next, "trial %d (%s at %zu): frame %d decoded, expected %d", trial,
+              fault_names[kind], pos, frame, next);
+        CHECK(memcmp(&decoded, &s->msgs[frame], sizeof(Message)) == 0,
+              "trial %d (%s at %zu): frame %d decoded differently", trial, fault_names[kind],
+              pos, frame);
+        next = frame + 1;
+    }
+    while (next >= first_bad && next <= last_bad) next++;
+    CHECK(next == STREAM_MSGS, "trial %d (%s at %zu): lost frames from %d on", trial,
+          fault_names[kind], pos, next);
+    CHECK(parser.frames_bad > 0 || escaped || intact == last_bad - first_bad + 1,
+          "trial %d (%s at %zu): damage neither rejected nor decoded", trial, fault_names[kind],
+          pos);
+    return escaped;
+}
+
+int main(void) {
+    Stream s;
+    build_stream(&s);
+
+    /* Clean stream: everything round-trips, nothing is rejected */
+    MsgParser parser;
+    msg_parser_init(&parser);
+    Message decoded;
+    int count = 0;
+    for (size_t i = 0; i < s.len; i++) {
+        if (msg_parser_feed(&parser, s.bytes[i], &decoded)) {
+            CHECK(count < STREAM_MSGS && memcmp(&decoded, &s.msgs[count], sizeof(Message)) == 0,
+                  "clean stream: message %d differs", count);
+            count++;
+        }
+    }
+    CHECK(count == STREAM_MSGS && parser.frames_bad == 0, "clean stream: %d decoded, %u bad",
+          count, parser.frames_bad);
+
+    int escapes[FAULT_KINDS] = { 0 };
+    for (int trial = 0; trial < TRIALS; trial++) {
+        if (trial % 64 == 0) build_stream(&s);
+        int kind = trial % FAULT_KINDS;
+        escapes[kind] += run_trial(&s, kind, trial);
+    }
+    for (int kind = 0; kind < FAULT_KINDS; kind++) {
+        CHECK(escapes[kind] <= ESCAPES_MAX, "%s: %d corrupted frames decoded in %d trials",
+              fault_names[kind], escapes[kind], TRIALS / FAULT_KINDS);
+    }
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("parser resync: %d trials OK; CRC escapes drop %d, insert %d, flip %d, join %d\n",
+           TRIALS, escapes[FAULT_DROP], escapes[FAULT_INSERT], escapes[FAULT_FLIP],
+           escapes[FAULT_JOIN]);
+    return 0;
+}